@@ -0,0 +1,86 @@
+#!/bin/bash
+# Time diskinfo, diskput and diskget on fresh images with 512, 1024 and 4096-byte
+# blocks, once with the generic block copy the tools normally use and once with
+# the copies specialized per block size (-DSPECIALIZE_BLOCK_SIZES)
+#
+# diskinfo has no specialized path; it is timed with its sidecar removed so every
+# run counts the whole FAT
+#
+# BENCH_SIZE_MB sets the size of the file copied in and out (default 64)
+# BENCH_RUNS sets how many times each tool is run per image (default 5)
+
+set -e
+
+SIZE_MB=${BENCH_SIZE_MB:-64}
+RUNS=${BENCH_RUNS:-5}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Build both variants of the tools being timed
+for variant in generic specialized; do
+    flags=""
+    if [ "$variant" = specialized ]; then
+        flags="-DSPECIALIZE_BLOCK_SIZES"
+    fi
+    mkdir "$WORK/$variant"
+    for tool in diskinfo diskget diskput; do
+        gcc -Wall -O2 -D_GNU_SOURCE -pthread $flags $tool.c -o "$WORK/$variant/$tool"
+    done
+done
+
+# Print a value as 4 big-endian bytes
+be32() {
+    printf "\\x$(printf %02x $(($1 >> 24 & 255)))\\x$(printf %02x $(($1 >> 16 & 255)))\\x$(printf %02x $(($1 >> 8 & 255)))\\x$(printf %02x $(($1 & 255)))"
+}
+
+# Write an empty image: superblock, FAT with the metadata blocks reserved, 8 root directory blocks
+makeImage() {
+    local path=$1 block_size=$2 block_count=$3
+    local fat_blocks=$(((block_count * 4 + block_size - 1) / block_size))
+    local reserved=$((1 + fat_blocks + 8))
+    truncate -s $((block_size * block_count)) "$path"
+    {
+        printf "CSC360FS"
+        printf "\\x$(printf %02x $((block_size >> 8)))\\x$(printf %02x $((block_size & 255)))"
+        be32 "$block_count"
+        be32 1
+        be32 "$fat_blocks"
+        be32 $((1 + fat_blocks))
+        be32 8
+    } | dd of="$path" conv=notrunc status=none
+    printf '\x00\x00\x00\x01%.0s' $(seq "$reserved") | dd of="$path" bs="$block_size" seek=1 conv=notrunc status=none
+}
+
+# Print the average milliseconds of RUNS runs of a command, running setup before each
+timeRuns() {
+    local setup=$1
+    shift
+    local total=0
+    for ((i = 0; i < RUNS; i++)); do
+        eval "$setup"
+        local start=$(date +%s%N)
+        "$@" > /dev/null
+        total=$((total + $(date +%s%N) - start))
+    done
+    echo $((total / RUNS / 1000000))
+}
+
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$WORK/data.bin"
+
+printf "%-6s %-12s %10s %10s %10s\n" "block" "variant" "info ms" "put ms" "get ms"
+for block_size in 512 1024 4096; do
+    # Room for the file twice over, since diskput writes the new copy before freeing the old one
+    block_count=$((SIZE_MB * 1024 * 1024 * 3 / block_size))
+    makeImage "$WORK/empty.img" "$block_size" "$block_count"
+    for variant in generic specialized; do
+        bin="$WORK/$variant"
+        image="$WORK/$variant-$block_size.img"
+        cp "$WORK/empty.img" "$image"
+        put=$(timeRuns "" "$bin/diskput" "$image" "$WORK/data.bin" /data.bin)
+        get=$(timeRuns "" "$bin/diskget" "$image" /data.bin "$WORK/out.bin")
+        cmp "$WORK/data.bin" "$WORK/out.bin"
+        info=$(timeRuns "rm -f '$image.alloc'" "$bin/diskinfo" "$image")
+        printf "%-6s %-12s %10s %10s %10s\n" "$block_size" "$variant" "$info" "$put" "$get"
+        rm -f "$image" "$image".*
+    done
+done
@@ -0,0 +1,276 @@
+#ifndef DISKALLOC_H
+#define DISKALLOC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+// Persistent allocation summary kept in a sidecar file next to the image
+//
+// The sidecar <image>.alloc holds the free/reserved/allocated counts and a
+// two-level free bitmap, so diskinfo can answer from the header alone and
+// diskput can find free blocks without scanning the FAT. It is only a cache:
+// it records the image generation (stored in the unused superblock bytes and
+// bumped by every diskput) together with the image's size, inode and
+// modification times. A write by an older tool changes the times, a write by
+// diskput changes the generation, and either makes the next tool rebuild the
+// summary from the FAT.
+
+#define ALLOC_MAGIC "SFSALLOC"
+#define ALLOC_VERSION 2
+
+// Offset of the big-endian image generation counter in the superblock block
+#define GENERATION_OFFSET 30
+
+// What a sidecar records about the image it was built from
+struct ImageStamp {
+    uint64_t image_size;
+    uint64_t image_inode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint32_t generation;
+    uint32_t unused;
+};
+
+struct AllocHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t fat_entries;
+    struct ImageStamp stamp;
+    uint32_t free_blocks;
+    uint32_t reserved_blocks;
+    uint32_t allocated_blocks;
+    uint32_t unused;
+};
+
+// Bit b of free_map[w] is set when block w * 64 + b is free; bit t of
+// summary_map[s] is set when free_map[s * 64 + t] has any free block
+struct AllocSummary {
+    struct AllocHeader header;
+    uint64_t* free_map;
+    uint64_t* summary_map;
+    uint32_t map_words;
+    uint32_t summary_words;
+};
+
+// Function to read the image generation counter
+static inline uint32_t readGeneration(const char* file) {
+    uint32_t generation;
+    memcpy(&generation, file + GENERATION_OFFSET, sizeof(uint32_t));
+    return ntohl(generation);
+}
+
+// Function to bump the image generation counter after a write
+static inline void bumpGeneration(char* file) {
+    uint32_t generation = htonl(readGeneration(file) + 1);
+    memcpy(file + GENERATION_OFFSET, &generation, sizeof(uint32_t));
+}
+
+// Function to build the sidecar path for an image
+static inline void allocPath(const char* image, char* path, size_t length) {
+    snprintf(path, length, "%s.alloc", image);
+}
+
+// Function to record the image's current generation and identity
+static inline void stampImage(struct ImageStamp* stamp, int fd, const char* file) {
+    struct stat buffer;
+    fstat(fd, &buffer);
+    memset(stamp, 0, sizeof(struct ImageStamp));
+    stamp->generation = readGeneration(file);
+    stamp->image_size = buffer.st_size;
+    stamp->image_inode = buffer.st_ino;
+    stamp->mtime_sec = buffer.st_mtim.tv_sec;
+    stamp->mtime_nsec = buffer.st_mtim.tv_nsec;
+    stamp->ctime_sec = buffer.st_ctim.tv_sec;
+    stamp->ctime_nsec = buffer.st_ctim.tv_nsec;
+}
+
+// Function to check whether a stored stamp still describes the image
+static inline int imageStampMatches(const struct ImageStamp* stamp, int fd, const char* file) {
+    struct ImageStamp current;
+    stampImage(&current, fd, file);
+    return memcmp(stamp, &current, sizeof(struct ImageStamp)) == 0;
+}
+
+// Function to stamp a header with the image's current identity
+static inline void stampAllocHeader(struct AllocHeader* header, int fd, const char* file) {
+    memcpy(header->magic, ALLOC_MAGIC, sizeof(header->magic));
+    header->version = ALLOC_VERSION;
+    stampImage(&header->stamp, fd, file);
+}
+
+// Function to check whether a stored header still describes the image
+static inline int allocHeaderMatches(const struct AllocHeader* header, int fd, const char* file, uint32_t fat_entries) {
+    return memcmp(header->magic, ALLOC_MAGIC, sizeof(header->magic)) == 0
+        && header->version == ALLOC_VERSION
+        && header->fat_entries == fat_entries
+        && imageStampMatches(&header->stamp, fd, file);
+}
+
+// Function to read just the counts; returns 1 if the sidecar is valid for the image
+static inline int loadAllocHeader(const char* image, int fd, const char* file, uint32_t fat_entries, struct AllocHeader* header) {
+    char path[4096];
+    allocPath(image, path, sizeof(path));
+    int alloc_fd = open(path, O_RDONLY);
+    if (alloc_fd == -1) {
+        return 0;
+    }
+    ssize_t length = pread(alloc_fd, header, sizeof(struct AllocHeader), 0);
+    close(alloc_fd);
+    return length == sizeof(struct AllocHeader) && allocHeaderMatches(header, fd, file, fat_entries);
+}
+
+// Function to size and allocate the bitmaps for fat_entries blocks
+static inline void allocateAllocMaps(struct AllocSummary* summary, uint32_t fat_entries) {
+    summary->map_words = (fat_entries + 63) / 64;
+    summary->summary_words = (summary->map_words + 63) / 64;
+    summary->free_map = (uint64_t*)calloc(summary->map_words + 1, sizeof(uint64_t));
+    summary->summary_map = (uint64_t*)calloc(summary->summary_words + 1, sizeof(uint64_t));
+    if (!summary->free_map || !summary->summary_map) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static inline void freeAllocSummary(struct AllocSummary* summary) {
+    free(summary->free_map);
+    free(summary->summary_map);
+    summary->free_map = NULL;
+    summary->summary_map = NULL;
+}
+
+// Function to load the counts and bitmaps; returns 1 if the sidecar is valid for the image
+static inline int loadAllocSummary(const char* image, int fd, const char* file, uint32_t fat_entries, struct AllocSummary* summary) {
+    char path[4096];
+    allocPath(image, path, sizeof(path));
+    int alloc_fd = open(path, O_RDONLY);
+    if (alloc_fd == -1) {
+        return 0;
+    }
+
+    int valid = 0;
+    ssize_t length = pread(alloc_fd, &summary->header, sizeof(struct AllocHeader), 0);
+    if (length == sizeof(struct AllocHeader) && allocHeaderMatches(&summary->header, fd, file, fat_entries)) {
+        allocateAllocMaps(summary, fat_entries);
+        size_t map_bytes = summary->map_words * sizeof(uint64_t);
+        size_t summary_bytes = summary->summary_words * sizeof(uint64_t);
+        valid = pread(alloc_fd, summary->free_map, map_bytes, sizeof(struct AllocHeader)) == map_bytes
+            && pread(alloc_fd, summary->summary_map, summary_bytes, sizeof(struct AllocHeader) + map_bytes) == summary_bytes;
+        if (!valid) {
+            freeAllocSummary(summary);
+        }
+    }
+    close(alloc_fd);
+    return valid;
+}
+
+// Function to rebuild the counts and bitmaps from the FAT
+// Free entries are zero and reserved entries are htonl(1) in either byte order,
+// so the raw entries are classified without converting them
+static inline void buildAllocSummary(const uint32_t* fatPtr, uint32_t fat_entries, struct AllocSummary* summary) {
+    const uint32_t reserved = htonl(0x00000001);
+    uint32_t free_blocks = 0;
+    uint32_t reserved_blocks = 0;
+
+    allocateAllocMaps(summary, fat_entries);
+    for (uint32_t w = 0; w < summary->map_words; w++) {
+        uint32_t base = w * 64;
+        uint32_t count = (fat_entries - base < 64) ? fat_entries - base : 64;
+        uint64_t bits = 0;
+        for (uint32_t b = 0; b < count; b++) {
+            bits |= (uint64_t)(fatPtr[base + b] == 0) << b;
+            reserved_blocks += (fatPtr[base + b] == reserved);
+        }
+        summary->free_map[w] = bits;
+        if (bits != 0) {
+            summary->summary_map[w / 64] |= (uint64_t)1 << (w % 64);
+        }
+        free_blocks += __builtin_popcountll(bits);
+    }
+
+    summary->header.fat_entries = fat_entries;
+    summary->header.free_blocks = free_blocks;
+    summary->header.reserved_blocks = reserved_blocks;
+    summary->header.allocated_blocks = fat_entries - free_blocks - reserved_blocks;
+}
+
+// Function to write the summary next to the image, replacing the old one atomically
+// The sidecar is only a cache, so failing to write it is not an error
+static inline void saveAllocSummary(const char* image, int fd, const char* file, struct AllocSummary* summary) {
+    char path[4096];
+    char temp_path[4096 + 32];
+    allocPath(image, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+
+    int alloc_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (alloc_fd == -1) {
+        return;
+    }
+    stampAllocHeader(&summary->header, fd, file);
+    size_t map_bytes = summary->map_words * sizeof(uint64_t);
+    size_t summary_bytes = summary->summary_words * sizeof(uint64_t);
+    int ok = write(alloc_fd, &summary->header, sizeof(struct AllocHeader)) == sizeof(struct AllocHeader)
+        && write(alloc_fd, summary->free_map, map_bytes) == map_bytes
+        && write(alloc_fd, summary->summary_map, summary_bytes) == summary_bytes;
+    close(alloc_fd);
+    if (!ok || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+    }
+}
+
+// Function to find the first free block at or after from; returns -1 if there is none
+static inline int64_t findFreeBlock(const struct AllocSummary* summary, uint32_t from) {
+    uint32_t w = from / 64;
+    if (w >= summary->map_words) {
+        return -1;
+    }
+
+    // Check the rest of the starting word first
+    uint64_t bits = summary->free_map[w] & (~(uint64_t)0 << (from % 64));
+    if (bits != 0) {
+        return (int64_t)w * 64 + __builtin_ctzll(bits);
+    }
+
+    // Then skip whole words with the summary bitmap
+    w++;
+    for (uint32_t s = w / 64; s < summary->summary_words; s++) {
+        uint64_t words = summary->summary_map[s];
+        if (s == w / 64) {
+            words &= ~(uint64_t)0 << (w % 64);
+        }
+        if (words != 0) {
+            uint32_t word = s * 64 + __builtin_ctzll(words);
+            return (int64_t)word * 64 + __builtin_ctzll(summary->free_map[word]);
+        }
+    }
+    return -1;
+}
+
+// Function to record that a free block is now part of a file or directory
+static inline void markBlockAllocated(struct AllocSummary* summary, uint32_t block) {
+    uint32_t w = block / 64;
+    summary->free_map[w] &= ~((uint64_t)1 << (block % 64));
+    if (summary->free_map[w] == 0) {
+        summary->summary_map[w / 64] &= ~((uint64_t)1 << (w % 64));
+    }
+    summary->header.free_blocks--;
+    summary->header.allocated_blocks++;
+}
+
+// Function to record that an allocated block was returned to the free list
+static inline void markBlockFree(struct AllocSummary* summary, uint32_t block) {
+    uint32_t w = block / 64;
+    summary->free_map[w] |= (uint64_t)1 << (block % 64);
+    summary->summary_map[w / 64] |= (uint64_t)1 << (w % 64);
+    summary->header.free_blocks++;
+    summary->header.allocated_blocks--;
+}
+
+#endif
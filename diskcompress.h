@@ -0,0 +1,188 @@
+#ifndef DISKCOMPRESS_H
+#define DISKCOMPRESS_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Compressed file layout and the LZ codec used for it
+//
+// A compressed file is a directory entry with status STATUS_COMPRESSED_FILE
+// (0x03 plus the COMPRESSED bit), which the older tools do not recognise and
+// skip. Its size field is the uncompressed size. Its block chain holds a
+// CompressedHeader, a table of ChunkEntry, and then the chunks, each being
+// CHUNK_SIZE bytes of the file compressed on its own. Any byte range can be
+// read by decompressing only the chunks that cover it, and chunks can be
+// decompressed in parallel. All fields are big-endian like the image.
+//
+// The codec is a byte-oriented LZ77 in the style of LZ4: each sequence is a
+// token (literal length in the high nibble, match length minus 4 in the low
+// nibble, 15 meaning more length bytes follow), the literals, and a 2-byte
+// little-endian match offset. The last sequence has literals only.
+
+#define STATUS_FILE 0x03
+#define STATUS_DIRECTORY 0x05
+#define STATUS_COMPRESSED 0x08
+#define STATUS_COMPRESSED_FILE (STATUS_FILE | STATUS_COMPRESSED)
+
+// Both plain and compressed files are files
+#define IS_FILE_STATUS(status) (((status) & ~STATUS_COMPRESSED) == STATUS_FILE)
+
+#define COMPRESSED_MAGIC 0x53465a31 // "SFZ1"
+#define CHUNK_SIZE 65536
+#define CHUNK_STORED 0x80000000     // length flag: chunk kept uncompressed
+
+struct __attribute__((__packed__)) CompressedHeader {
+    uint32_t magic;
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+    uint32_t size;
+};
+
+// Offset is from the end of the chunk table
+struct __attribute__((__packed__)) ChunkEntry {
+    uint32_t offset;
+    uint32_t length;
+};
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5
+
+// Worst-case compressed size of length input bytes
+static inline uint32_t lzBound(uint32_t length) {
+    return length + length / 255 + 16;
+}
+
+static inline uint32_t lzHash(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(uint32_t));
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t* lzWriteLength(uint8_t* op, uint32_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+static inline uint8_t* lzWriteSequence(uint8_t* op, const uint8_t* literals, uint32_t literal_length, uint32_t offset, uint32_t match_length) {
+    uint8_t* token = op++;
+    *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15) {
+        op = lzWriteLength(op, literal_length - 15);
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length > 0) {
+        uint32_t code = match_length - LZ_MIN_MATCH;
+        *token |= (uint8_t)(code < 15 ? code : 15);
+        *op++ = (uint8_t)(offset & 0xFF);
+        *op++ = (uint8_t)(offset >> 8);
+        if (code >= 15) {
+            op = lzWriteLength(op, code - 15);
+        }
+    }
+    return op;
+}
+
+// Function to compress src into dst, which must hold lzBound(length) bytes
+// Returns the compressed length
+static inline uint32_t lzCompress(const uint8_t* src, uint32_t length, uint8_t* dst) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + length;
+    const uint8_t* match_limit = (length > LZ_LAST_LITERALS + LZ_MIN_MATCH) ? end - LZ_LAST_LITERALS - LZ_MIN_MATCH : src;
+    uint8_t* op = dst;
+
+    memset(table, 0xFF, sizeof(table));
+    while (ip < match_limit) {
+        uint32_t hash = lzHash(ip);
+        uint32_t candidate = table[hash];
+        table[hash] = (uint32_t)(ip - src);
+        if (candidate == 0xFFFFFFFF || ip - (src + candidate) > LZ_MAX_OFFSET || memcmp(src + candidate, ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        // Extend the match, leaving the last bytes as literals
+        const uint8_t* match = src + candidate;
+        uint32_t match_length = LZ_MIN_MATCH;
+        while (ip + match_length < end - LZ_LAST_LITERALS && ip[match_length] == match[match_length]) {
+            match_length++;
+        }
+
+        op = lzWriteSequence(op, anchor, ip - anchor, ip - match, match_length);
+        ip += match_length;
+        anchor = ip;
+    }
+    op = lzWriteSequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+static inline int lzReadLength(const uint8_t** ip, const uint8_t* end, uint32_t* length) {
+    uint8_t byte;
+    do {
+        if (*ip >= end) {
+            return 0;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+// Function to decompress src into dst of capacity bytes
+// Returns the decompressed length, or -1 if the input is corrupt
+static inline int64_t lzDecompress(const uint8_t* src, uint32_t length, uint8_t* dst, uint32_t capacity) {
+    const uint8_t* ip = src;
+    const uint8_t* end = src + length;
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + capacity;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+
+        // Literals
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 15 && !lzReadLength(&ip, end, &literal_length)) {
+            return -1;
+        }
+        if (literal_length > (uint32_t)(end - ip) || literal_length > (uint32_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        if (ip == end) {
+            break; // The last sequence has no match
+        }
+
+        // Match, which may overlap the bytes it produces
+        if (end - ip < 2) {
+            return -1;
+        }
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        uint32_t match_length = token & 0x0F;
+        if (match_length == 15 && !lzReadLength(&ip, end, &match_length)) {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (uint32_t)(op - dst) || match_length > (uint32_t)(op_end - op)) {
+            return -1;
+        }
+        const uint8_t* match = op - offset;
+        for (uint32_t i = 0; i < match_length; i++) {
+            op[i] = match[i];
+        }
+        op += match_length;
+    }
+    return op - dst;
+}
+
+#endif
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include "disklock.h"
+#include "diskpatch.h"
+
+struct __attribute__((__packed__)) dir_entry_timedate_t {
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+};
+
+struct __attribute__((__packed__)) dir_entry_t {
+    uint8_t status;
+    uint32_t starting_block;
+    uint32_t block_count;
+    uint32_t size;
+    struct dir_entry_timedate_t create_time;
+    struct dir_entry_timedate_t modify_time;
+    uint8_t filename[31];
+    uint8_t unused[6];
+};
+
+struct __attribute__((__packed__)) SuperBlock {
+    uint16_t block_size;
+    uint32_t block_count;
+    uint32_t fat_starts;
+    uint32_t fat_blocks;
+    uint32_t root_dir_starts;
+    uint32_t root_dir_blocks;
+};
+
+struct DiffCounts {
+    int blocks;
+    int fat_entries;
+    int dir_entries;
+};
+
+// Function to read the super block of a mapped image
+struct SuperBlock readSuperBlock(const char* file) {
+    struct SuperBlock superBlock;
+    superBlock.block_size = ntohs(*((uint16_t*)(file + 8)));
+    superBlock.block_count = ntohl(*((uint32_t*)(file + 10)));
+    superBlock.fat_starts = ntohl(*((uint32_t*)(file + 14)));
+    superBlock.fat_blocks = ntohl(*((uint32_t*)(file + 18)));
+    superBlock.root_dir_starts = ntohl(*((uint32_t*)(file + 22)));
+    superBlock.root_dir_blocks = ntohl(*((uint32_t*)(file + 26)));
+    return superBlock;
+}
+
+// Function to check whether a stat result names the file open on fd
+int sameFile(const struct stat* target, int fd) {
+    struct stat buffer;
+    fstat(fd, &buffer);
+    return target->st_dev == buffer.st_dev && target->st_ino == buffer.st_ino;
+}
+
+// Function to open, lock and map an image read-only
+char* mapImage(const char* path, int* fd, int* size) {
+    *fd = open(path, O_RDONLY);
+    if (*fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    // Keep writers out while diffing by sharing their lock
+    lockRange(*fd, F_RDLCK, WRITER_LOCK_START, WRITER_LOCK_LEN);
+
+    struct stat buffer;
+    fstat(*fd, &buffer);
+    *size = buffer.st_size;
+
+    char* file = mmap(NULL, *size, PROT_READ, MAP_SHARED, *fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+// Function to mark every directory block reachable from a directory in the new image
+void markDirBlocks(const char* file, struct SuperBlock* superBlock, uint32_t block_start, uint32_t block_count, uint8_t* isDirBlock) {
+    if (block_start >= superBlock->block_count || block_count > superBlock->block_count - block_start) {
+        return;
+    }
+    for (uint32_t b = 0; b < block_count; b++) {
+        if (isDirBlock[block_start + b]) {
+            return; // Already visited
+        }
+        isDirBlock[block_start + b] = 1;
+    }
+
+    struct dir_entry_t* dirPtr = (struct dir_entry_t*)(file + (size_t)block_start * superBlock->block_size);
+    for (int i = 0; i < block_count * superBlock->block_size / sizeof(struct dir_entry_t); i++) {
+        if (dirPtr[i].status == 0x05) {
+            markDirBlocks(file, superBlock, ntohl(dirPtr[i].starting_block), ntohl(dirPtr[i].block_count), isDirBlock);
+        }
+    }
+}
+
+void writeRecord(FILE* patch, uint8_t type, uint32_t block, uint32_t index, const void* payload, size_t length) {
+    struct PatchRecord record;
+    record.type = type;
+    record.block = htonl(block);
+    record.index = htonl(index);
+    if (fwrite(&record, sizeof(struct PatchRecord), 1, patch) != 1 || (length > 0 && fwrite(payload, length, 1, patch) != 1)) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 4) {
+        printf("Usage: %s <base_image> <new_image> <patch_file>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int base_fd, new_fd, base_size, new_size;
+    char* base = mapImage(argv[1], &base_fd, &base_size);
+    char* file = mapImage(argv[2], &new_fd, &new_size);
+    struct SuperBlock baseSuperBlock = readSuperBlock(base);
+    struct SuperBlock superBlock = readSuperBlock(file);
+
+    if (base_size != new_size || memcmp(&baseSuperBlock, &superBlock, sizeof(struct SuperBlock)) != 0) {
+        printf("Error: Images have different geometry.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t block_size = superBlock.block_size;
+    if ((uint64_t)superBlock.block_count * block_size > (uint64_t)new_size) {
+        printf("Error: Image is smaller than its block count.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t* baseFatPtr = (uint32_t*)(base + superBlock.fat_starts * block_size);
+    uint32_t* fatPtr = (uint32_t*)(file + superBlock.fat_starts * block_size);
+    uint32_t fat_entries = superBlock.fat_blocks * block_size / sizeof(uint32_t);
+
+    // Find the directory blocks of the new image; they are diffed entry by entry
+    uint8_t* isDirBlock = (uint8_t*)calloc(superBlock.block_count, 1);
+    if (!isDirBlock) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    markDirBlocks(file, &superBlock, superBlock.root_dir_starts, superBlock.root_dir_blocks, isDirBlock);
+
+    // Opening the patch truncates it, so it must not be either image
+    struct stat target;
+    if (stat(argv[3], &target) == 0 && (sameFile(&target, base_fd) || sameFile(&target, new_fd))) {
+        printf("Error: Patch file would overwrite an image.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* patch = fopen(argv[3], "wb");
+    if (!patch) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    struct PatchHeader header;
+    memset(&header, 0, sizeof(struct PatchHeader));
+    memcpy(header.magic, PATCH_MAGIC, sizeof(header.magic));
+    header.version = htonl(PATCH_VERSION);
+    header.block_size = htons(superBlock.block_size);
+    header.block_count = htonl(superBlock.block_count);
+    header.fat_starts = htonl(superBlock.fat_starts);
+    header.fat_blocks = htonl(superBlock.fat_blocks);
+    header.base_fat_hash = htonll(hashFat(baseFatPtr, fat_entries));
+    fwrite(&header, sizeof(struct PatchHeader), 1, patch);
+
+    // Records go out in the order they are safe to apply: data blocks first,
+    // then the FAT, then the directory entries that make them reachable
+    struct DiffCounts counts = {0, 0, 0};
+    uint32_t fat_end = superBlock.fat_starts + superBlock.fat_blocks;
+    for (uint32_t b = 1; b < superBlock.block_count; b++) {
+        if (isDirBlock[b] || (b >= superBlock.fat_starts && b < fat_end)) {
+            continue;
+        }
+        // Free blocks are unreachable, so their contents do not matter
+        if (b < fat_entries && fatPtr[b] == 0x00000000) {
+            continue;
+        }
+        size_t offset = (size_t)b * block_size;
+        if (memcmp(base + offset, file + offset, block_size) != 0) {
+            writeRecord(patch, PATCH_BLOCK, b, 0, file + offset, block_size);
+            counts.blocks++;
+        }
+    }
+
+    for (uint32_t i = 0; i < fat_entries; i++) {
+        if (baseFatPtr[i] != fatPtr[i]) {
+            writeRecord(patch, PATCH_FAT, 0, i, &fatPtr[i], sizeof(uint32_t));
+            counts.fat_entries++;
+        }
+    }
+
+    for (uint32_t b = 0; b < superBlock.block_count; b++) {
+        if (!isDirBlock[b]) {
+            continue;
+        }
+        struct dir_entry_t* baseDirPtr = (struct dir_entry_t*)(base + (size_t)b * block_size);
+        struct dir_entry_t* dirPtr = (struct dir_entry_t*)(file + (size_t)b * block_size);
+        for (uint32_t i = 0; i < block_size / sizeof(struct dir_entry_t); i++) {
+            if (memcmp(&baseDirPtr[i], &dirPtr[i], sizeof(struct dir_entry_t)) != 0) {
+                writeRecord(patch, PATCH_ENTRY, b, i, &dirPtr[i], sizeof(struct dir_entry_t));
+                counts.dir_entries++;
+            }
+        }
+    }
+
+    // The super block (and its generation counter) goes last
+    if (memcmp(base, file, block_size) != 0) {
+        writeRecord(patch, PATCH_BLOCK, 0, 0, file, block_size);
+        counts.blocks++;
+    }
+
+    writeRecord(patch, PATCH_END, 0, 0, NULL, 0);
+    if (fclose(patch) != 0) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Patch written: %d blocks, %d FAT entries, %d directory entries.\n", counts.blocks, counts.fat_entries, counts.dir_entries);
+
+    free(isDirBlock);
+
+    // Unmap the files
+    munmap(file, new_size);
+    munmap(base, base_size);
+
+    // Close the files
+    close(new_fd);
+    close(base_fd);
+
+    return 0;
+}
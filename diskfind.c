@@ -0,0 +1,605 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include "disklock.h"
+#include "diskcompress.h"
+
+struct __attribute__((__packed__)) dir_entry_timedate_t {
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+};
+
+struct __attribute__((__packed__)) dir_entry_t {
+    uint8_t status;
+    uint32_t starting_block;
+    uint32_t block_count;
+    uint32_t size;
+    struct dir_entry_timedate_t create_time;
+    struct dir_entry_timedate_t modify_time;
+    uint8_t filename[31];
+    uint8_t unused[6];
+};
+
+struct __attribute__((__packed__)) SuperBlock {
+    uint16_t block_size;
+    uint32_t block_count;
+    uint32_t fat_starts;
+    uint32_t fat_blocks;
+    uint32_t root_dir_starts;
+    uint32_t root_dir_blocks;
+};
+
+#define MAX_WORKERS 64
+#define MAX_PATH_LENGTH 4096
+#define OUTPUT_BUFFER_SIZE 65536
+
+// Comparison used by the -size and -mtime predicates
+enum Compare {
+    COMPARE_ANY,
+    COMPARE_LESS,
+    COMPARE_EQUAL,
+    COMPARE_GREATER
+};
+
+struct FindOptions {
+    const char* name;         // glob matched against the entry name, NULL for any
+    int name_flags;           // fnmatch flags, FNM_CASEFOLD for -iname
+    char type;                // 'f', 'd' or 0 for both
+    enum Compare size_compare;
+    uint32_t size;
+    enum Compare mtime_compare;
+    long mtime_days;
+    int du;                   // print per-subtree totals instead of matches
+};
+
+// A directory waiting to be scanned, and its subtree totals for du mode
+// pending counts the directory itself plus each subdirectory not yet finished;
+// whoever drops it to zero reports the directory and adds its totals to the parent
+struct DirTask {
+    char* path;
+    uint32_t block_start;
+    uint32_t block_count;
+    struct DirTask* parent;
+    int pending;
+    uint64_t total_size;
+    uint64_t total_blocks;
+};
+
+// Per-worker deque: the owner pushes and pops at the tail, idle workers steal from the head
+struct WorkQueue {
+    pthread_mutex_t lock;
+    struct DirTask** tasks;
+    int head;
+    int tail;
+    int capacity;
+};
+
+struct FindContext;
+
+struct Worker {
+    int id;
+    struct FindContext* context;
+    int lock_fd;              // own descriptor so each worker's shared locks are independent
+    pthread_t thread;
+    struct WorkQueue queue;
+    char output[OUTPUT_BUFFER_SIZE];
+    int output_length;
+};
+
+struct FindContext {
+    char* file;
+    const char* image;
+    struct SuperBlock superBlock;
+    struct FindOptions options;
+    time_t now;
+    struct Worker* workers;
+    int worker_count;
+    uint8_t* visited;         // set for the first block of every directory already queued
+    int outstanding;          // directories queued or being scanned
+    pthread_mutex_t output_lock;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;   // signalled when a directory is queued or the search ends
+    int idle_workers;
+};
+
+// Function to add a directory to the tail of a worker's queue and wake an idle worker to steal it
+void pushTask(struct FindContext* context, struct WorkQueue* queue, struct DirTask* task) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->capacity) {
+        if (queue->head > 0) {
+            // Reuse the space left behind by stolen tasks
+            memmove(queue->tasks, queue->tasks + queue->head, (queue->tail - queue->head) * sizeof(struct DirTask*));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        } else {
+            queue->capacity *= 2;
+            queue->tasks = (struct DirTask**)realloc(queue->tasks, queue->capacity * sizeof(struct DirTask*));
+            if (!queue->tasks) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    queue->tasks[queue->tail++] = task;
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_mutex_lock(&context->idle_lock);
+    if (context->idle_workers > 0) {
+        pthread_cond_signal(&context->idle_cond);
+    }
+    pthread_mutex_unlock(&context->idle_lock);
+}
+
+// Function to take the most recently pushed directory from the owner's end
+struct DirTask* popTask(struct WorkQueue* queue) {
+    struct DirTask* task = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head) {
+        task = queue->tasks[--queue->tail];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+// Function to check whether a queue has a directory waiting
+int hasTask(struct WorkQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    int waiting = queue->tail > queue->head;
+    pthread_mutex_unlock(&queue->lock);
+    return waiting;
+}
+
+// Function to take the oldest directory, usually the largest subtree, from another worker
+struct DirTask* stealTask(struct WorkQueue* queue) {
+    struct DirTask* task = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head) {
+        task = queue->tasks[queue->head++];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+// Function to write a worker's buffered lines to stdout
+void flushOutput(struct FindContext* context, struct Worker* worker) {
+    if (worker->output_length == 0) {
+        return;
+    }
+    pthread_mutex_lock(&context->output_lock);
+    fwrite(worker->output, 1, worker->output_length, stdout);
+    fflush(stdout);
+    pthread_mutex_unlock(&context->output_lock);
+    worker->output_length = 0;
+}
+
+// Function to append one line to a worker's output buffer
+__attribute__((format(printf, 3, 4)))
+void emitLine(struct FindContext* context, struct Worker* worker, const char* format, ...) {
+    if (worker->output_length > OUTPUT_BUFFER_SIZE - MAX_PATH_LENGTH - 64) {
+        flushOutput(context, worker);
+    }
+    va_list args;
+    va_start(args, format);
+    worker->output_length += vsnprintf(worker->output + worker->output_length, OUTPUT_BUFFER_SIZE - worker->output_length, format, args);
+    va_end(args);
+}
+
+int compareValue(enum Compare compare, long value, long target) {
+    switch (compare) {
+        case COMPARE_LESS:
+            return value < target;
+        case COMPARE_EQUAL:
+            return value == target;
+        case COMPARE_GREATER:
+            return value > target;
+        default:
+            return 1;
+    }
+}
+
+// Function to check an entry against the -name, -type, -size and -mtime predicates
+int matchEntry(struct FindContext* context, const struct dir_entry_t* dirEntry) {
+    struct FindOptions* options = &context->options;
+
+    if (options->type == 'f' && !IS_FILE_STATUS(dirEntry->status)) {
+        return 0;
+    }
+    if (options->type == 'd' && dirEntry->status != 0x05) {
+        return 0;
+    }
+    if (options->name && fnmatch(options->name, (const char*)dirEntry->filename, options->name_flags) != 0) {
+        return 0;
+    }
+    if (!compareValue(options->size_compare, ntohl(dirEntry->size), options->size)) {
+        return 0;
+    }
+    if (options->mtime_compare != COMPARE_ANY) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(struct tm));
+        tm.tm_year = ntohs(dirEntry->modify_time.year) - 1900;
+        tm.tm_mon = dirEntry->modify_time.month - 1;
+        tm.tm_mday = dirEntry->modify_time.day;
+        tm.tm_hour = dirEntry->modify_time.hour;
+        tm.tm_min = dirEntry->modify_time.minute;
+        tm.tm_sec = dirEntry->modify_time.second;
+        tm.tm_isdst = -1;
+        long age_days = (long)((context->now - mktime(&tm)) / 86400);
+        if (!compareValue(options->mtime_compare, age_days, options->mtime_days)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to finish a directory once it and all of its subdirectories are scanned
+void completeDir(struct FindContext* context, struct Worker* worker, struct DirTask* task) {
+    while (task != NULL && __atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct DirTask* parent = task->parent;
+        uint64_t total_size = __atomic_load_n(&task->total_size, __ATOMIC_ACQUIRE);
+        uint64_t total_blocks = __atomic_load_n(&task->total_blocks, __ATOMIC_ACQUIRE);
+        if (context->options.du) {
+            emitLine(context, worker, "%12llu %10llu %s\n", (unsigned long long)total_size, (unsigned long long)total_blocks, task->path);
+        }
+        if (parent != NULL) {
+            __atomic_add_fetch(&parent->total_size, total_size, __ATOMIC_ACQ_REL);
+            __atomic_add_fetch(&parent->total_blocks, total_blocks, __ATOMIC_ACQ_REL);
+        }
+        free(task->path);
+        free(task);
+        task = parent;
+    }
+}
+
+// Function to check that a directory's blocks lie inside the image
+int dirInRange(const struct SuperBlock* superBlock, uint32_t block_start, uint32_t block_count) {
+    return block_start < superBlock->block_count && block_count <= superBlock->block_count - block_start;
+}
+
+// Function to claim a directory for scanning; returns 0 if it is out of range or
+// already claimed, so a corrupt entry or a loop back to an ancestor is scanned at most once
+int claimDir(struct FindContext* context, uint32_t block_start, uint32_t block_count) {
+    return dirInRange(&context->superBlock, block_start, block_count)
+        && __atomic_exchange_n(&context->visited[block_start], 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+// Function to scan one directory, reporting matches and queueing its subdirectories
+void scanDir(struct FindContext* context, struct Worker* worker, struct DirTask* task) {
+    int block_size = context->superBlock.block_size;
+    struct dir_entry_t* dirPtr = (struct dir_entry_t*)(context->file + (size_t)task->block_start * block_size);
+    size_t path_length = strlen(task->path);
+    uint64_t own_size = 0;
+    uint64_t own_blocks = 0;
+
+    // Hold a shared lock on the directory so an entry being replaced is never read half-written
+    off_t dir_offset = (off_t)task->block_start * block_size;
+    off_t dir_length = (off_t)task->block_count * block_size;
+    lockRange(worker->lock_fd, F_RDLCK, dir_offset, dir_length);
+    for (int i = 0; i < task->block_count * block_size / sizeof(struct dir_entry_t); i++) {
+        // Skip empty entries without converting them
+        if (!IS_FILE_STATUS(dirPtr[i].status) && dirPtr[i].status != 0x05) {
+            continue;
+        }
+        struct dir_entry_t dirEntry = dirPtr[i]; // Create a copy of the data
+        dirEntry.filename[30] = '\0';
+
+        char path[MAX_PATH_LENGTH];
+        int written = snprintf(path, sizeof(path), "%s%s%s", task->path, path_length > 1 ? "/" : "", (const char*)dirEntry.filename);
+        if (written >= (int)sizeof(path)) {
+            fprintf(stderr, "Error: Path too long under %s, skipping.\n", task->path);
+            continue;
+        }
+
+        own_blocks += ntohl(dirEntry.block_count);
+        if (IS_FILE_STATUS(dirEntry.status)) {
+            own_size += ntohl(dirEntry.size);
+        }
+        if (!context->options.du && matchEntry(context, &dirEntry)) {
+            emitLine(context, worker, "%c %10u %s\n", dirEntry.status == 0x05 ? 'D' : 'F', ntohl(dirEntry.size), path);
+        }
+
+        if (dirEntry.status == 0x05 && claimDir(context, ntohl(dirEntry.starting_block), ntohl(dirEntry.block_count))) {
+            struct DirTask* child = (struct DirTask*)calloc(1, sizeof(struct DirTask));
+            if (!child || !(child->path = strdup(path))) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            child->block_start = ntohl(dirEntry.starting_block);
+            child->block_count = ntohl(dirEntry.block_count);
+            child->parent = task;
+            child->pending = 1;
+            __atomic_add_fetch(&task->pending, 1, __ATOMIC_ACQ_REL);
+            __atomic_add_fetch(&context->outstanding, 1, __ATOMIC_ACQ_REL);
+            pushTask(context, &worker->queue, child);
+        }
+    }
+    unlockRange(worker->lock_fd, dir_offset, dir_length);
+
+    __atomic_add_fetch(&task->total_size, own_size, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&task->total_blocks, own_blocks, __ATOMIC_ACQ_REL);
+    completeDir(context, worker, task);
+}
+
+// Function to park an idle worker until a directory is queued or the search ends
+// Queues and the count are checked under idle_lock, and pushTask and the last
+// completion signal under it, so a wakeup is never missed
+void waitForWork(struct FindContext* context) {
+    pthread_mutex_lock(&context->idle_lock);
+    context->idle_workers++;
+    for (;;) {
+        int ready = __atomic_load_n(&context->outstanding, __ATOMIC_ACQUIRE) == 0;
+        for (int i = 0; !ready && i < context->worker_count; i++) {
+            ready = hasTask(&context->workers[i].queue);
+        }
+        if (ready) {
+            break;
+        }
+        pthread_cond_wait(&context->idle_cond, &context->idle_lock);
+    }
+    context->idle_workers--;
+    pthread_mutex_unlock(&context->idle_lock);
+}
+
+void* runWorker(void* arg) {
+    struct Worker* worker = (struct Worker*)arg;
+    struct FindContext* context = worker->context;
+
+    worker->lock_fd = open(context->image, O_RDONLY);
+    if (worker->lock_fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    while (__atomic_load_n(&context->outstanding, __ATOMIC_ACQUIRE) > 0) {
+        struct DirTask* task = popTask(&worker->queue);
+
+        // Out of local work, so try to steal from the other workers
+        for (int i = 1; task == NULL && i < context->worker_count; i++) {
+            task = stealTask(&context->workers[(worker->id + i) % context->worker_count].queue);
+        }
+        if (task == NULL) {
+            waitForWork(context);
+            continue;
+        }
+
+        scanDir(context, worker, task);
+        if (__atomic_sub_fetch(&context->outstanding, 1, __ATOMIC_ACQ_REL) == 0) {
+            // The search is over, so wake the idle workers to exit
+            pthread_mutex_lock(&context->idle_lock);
+            pthread_cond_broadcast(&context->idle_cond);
+            pthread_mutex_unlock(&context->idle_lock);
+        }
+    }
+
+    flushOutput(context, worker);
+    close(worker->lock_fd);
+    return NULL;
+}
+
+// Function to parse a [+-]N argument into a comparison and a value
+void parseCompare(const char* arg, enum Compare* compare, long* value) {
+    char* end;
+    *compare = COMPARE_EQUAL;
+    if (arg[0] == '+') {
+        *compare = COMPARE_GREATER;
+        arg++;
+    } else if (arg[0] == '-') {
+        *compare = COMPARE_LESS;
+        arg++;
+    }
+    *value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || *value < 0) {
+        printf("Error: Invalid number %s.\n", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void printUsage(const char* program) {
+    printf("Usage: %s <file_system_image> </subdir1/subdir2/...(optional)> [-name glob] [-iname glob] [-type f|d] [-size [+-]bytes] [-mtime [+-]days] [-du] [-j threads]\n", program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printUsage(argv[0]);
+    }
+
+    struct FindContext context;
+    memset(&context, 0, sizeof(struct FindContext));
+    context.image = argv[1];
+    context.now = time(NULL);
+    int worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    char* startPath = NULL;
+
+    // Parse the predicates
+    for (int i = 2; i < argc; i++) {
+        int has_value = (i + 1 < argc);
+        if (strcmp(argv[i], "-name") == 0 && has_value) {
+            context.options.name = argv[++i];
+        } else if (strcmp(argv[i], "-iname") == 0 && has_value) {
+            context.options.name = argv[++i];
+            context.options.name_flags = FNM_CASEFOLD;
+        } else if (strcmp(argv[i], "-type") == 0 && has_value) {
+            context.options.type = argv[++i][0];
+            if ((context.options.type != 'f' && context.options.type != 'd') || argv[i][1] != '\0') {
+                printUsage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-size") == 0 && has_value) {
+            long size;
+            parseCompare(argv[++i], &context.options.size_compare, &size);
+            context.options.size = size;
+        } else if (strcmp(argv[i], "-mtime") == 0 && has_value) {
+            parseCompare(argv[++i], &context.options.mtime_compare, &context.options.mtime_days);
+        } else if (strcmp(argv[i], "-du") == 0) {
+            context.options.du = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && has_value) {
+            worker_count = atoi(argv[++i]);
+        } else if (argv[i][0] == '/' && startPath == NULL) {
+            startPath = argv[i];
+        } else {
+            printUsage(argv[0]);
+        }
+    }
+    if (worker_count < 1) {
+        worker_count = 1;
+    } else if (worker_count > MAX_WORKERS) {
+        worker_count = MAX_WORKERS;
+    }
+
+    // Open the file system image read-only; readers only take shared locks
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat buffer;
+    fstat(fd, &buffer);
+    int size = buffer.st_size;
+
+    // Map the file system image into memory
+    char* file = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    context.file = file;
+
+    // Read super block information
+    struct SuperBlock superBlock;
+
+    superBlock.block_size = ntohs(*((uint16_t*)(file + 8)));
+    superBlock.block_count = ntohl(*((uint32_t*)(file + 10)));
+    superBlock.fat_starts = ntohl(*((uint32_t*)(file + 14)));
+    superBlock.fat_blocks = ntohl(*((uint32_t*)(file + 18)));
+    superBlock.root_dir_starts = ntohl(*((uint32_t*)(file + 22)));
+    superBlock.root_dir_blocks = ntohl(*((uint32_t*)(file + 26)));
+    context.superBlock = superBlock;
+    if ((uint64_t)superBlock.block_count * superBlock.block_size > (uint64_t)size) {
+        printf("Error: Image is smaller than its block count.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Walk down to the starting directory
+    char rootPath[MAX_PATH_LENGTH] = "";
+    int block_start = superBlock.root_dir_starts;
+    int block_count = superBlock.root_dir_blocks;
+    if (startPath != NULL) {
+        char* token = strtok(startPath, "/");
+        while (token != NULL) {
+            if (!dirInRange(&superBlock, block_start, block_count)) {
+                printf("File not found.\n");
+                exit(EXIT_FAILURE);
+            }
+            struct dir_entry_t* dirPtr = (struct dir_entry_t*)(file + block_start * superBlock.block_size);
+            int found = 0;
+            for (int i = 0; i < block_count * superBlock.block_size / sizeof(struct dir_entry_t); i++) {
+                // Only the matching entry is converted to host byte order
+                if (dirPtr[i].status == 0x05 && strcmp((const char*)dirPtr[i].filename, token) == 0) {
+                    block_start = ntohl(dirPtr[i].starting_block);
+                    block_count = ntohl(dirPtr[i].block_count);
+                    found = 1;
+                    break;
+                }
+            }
+            if (found == 0) {
+                printf("File not found.\n");
+                exit(EXIT_FAILURE);
+            }
+            if (strlen(rootPath) + strlen(token) + 2 > sizeof(rootPath)) {
+                printf("Error: Path too long.\n");
+                exit(EXIT_FAILURE);
+            }
+            strcat(rootPath, "/");
+            strcat(rootPath, token);
+            token = strtok(NULL, "/");
+        }
+    }
+    if (rootPath[0] == '\0') {
+        strcpy(rootPath, "/");
+    }
+
+    struct DirTask* root = (struct DirTask*)calloc(1, sizeof(struct DirTask));
+    if (!root || !(root->path = strdup(rootPath))) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    root->block_start = block_start;
+    root->block_count = block_count;
+    root->pending = 1;
+    context.visited = (uint8_t*)calloc(superBlock.block_count > 0 ? superBlock.block_count : 1, 1);
+    if (!context.visited) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (!claimDir(&context, block_start, block_count)) {
+        printf("Error: Directory is outside the image.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Start the workers with the starting directory on the first queue
+    context.worker_count = worker_count;
+    context.workers = (struct Worker*)calloc(worker_count, sizeof(struct Worker));
+    if (!context.workers) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&context.output_lock, NULL);
+    pthread_mutex_init(&context.idle_lock, NULL);
+    pthread_cond_init(&context.idle_cond, NULL);
+    for (int i = 0; i < worker_count; i++) {
+        struct Worker* worker = &context.workers[i];
+        worker->id = i;
+        worker->context = &context;
+        pthread_mutex_init(&worker->queue.lock, NULL);
+        worker->queue.capacity = 64;
+        worker->queue.tasks = (struct DirTask**)malloc(worker->queue.capacity * sizeof(struct DirTask*));
+        if (!worker->queue.tasks) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    context.outstanding = 1;
+    pushTask(&context, &context.workers[0].queue, root);
+
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&context.workers[i].thread, NULL, runWorker, &context.workers[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(context.workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        free(context.workers[i].queue.tasks);
+        pthread_mutex_destroy(&context.workers[i].queue.lock);
+    }
+    free(context.workers);
+    free(context.visited);
+    pthread_mutex_destroy(&context.output_lock);
+    pthread_mutex_destroy(&context.idle_lock);
+    pthread_cond_destroy(&context.idle_cond);
+
+    // Unmap the file
+    munmap(file, size);
+
+    // Close the file
+    close(fd);
+
+    return 0;
+}
@@ -8,6 +8,11 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <errno.h>
+#include "disklock.h"
+#include "diskcompress.h"
+#include "diskindex.h"
 
 struct __attribute__((__packed__)) dir_entry_timedate_t {
     uint16_t year;
@@ -44,6 +49,77 @@ struct FatInfo {
     int allocated_blocks;
 };
 
+#define MAX_DECOMPRESS_THREADS 16
+
+// Shared state for the threads decompressing one compressed file
+struct ChunkReader {
+    char* file;
+    uint32_t block_size;
+    uint32_t* blocks;         // the file's block chain in order
+    uint32_t block_total;
+    uint32_t data_start;      // stored offset of the first chunk, after the chunk table
+    struct ChunkEntry* table; // in host byte order
+    uint32_t chunk_count;
+    uint32_t chunk_size;
+    uint32_t size;
+    int output_fd;
+    int seekable;             // chunks are written at their offsets; otherwise in order by one thread
+    uint32_t next_chunk;
+    int failed;               // one of the READER_ values below
+    int write_errno;
+};
+
+#define READER_OK 0
+#define READER_CORRUPT 1
+#define READER_WRITE_FAILED 2
+
+// Benchmark builds (make bench) compile the block copy once per common block size
+// so it can be timed against the generic one; see bench.sh
+#ifdef SPECIALIZE_BLOCK_SIZES
+#define BLOCK_SIZE_INLINE static inline __attribute__((always_inline))
+#else
+#define BLOCK_SIZE_INLINE
+#endif
+
+// Function to copy a file's block chain to an open descriptor
+// Contiguous runs of blocks are written with a single call
+BLOCK_SIZE_INLINE
+void copyBlockChain(int fd, char* file, uint32_t file_size, uint32_t block_size, uint32_t block_start, uint32_t block_count, uint32_t* fatPtr) {
+    uint32_t fatEntry = block_start;
+    uint32_t run_start = block_start;
+    uint32_t run_blocks = 0;
+
+    for (uint32_t j = 0; j < block_count && file_size > 0; j++) {
+        run_blocks++;
+        uint32_t nextEntry = ntohl(*(fatPtr + fatEntry));
+
+        // Flush the run once the chain stops being contiguous or the file is covered
+        int last = (nextEntry > 0xFFFFFF00 || j + 1 == block_count || (uint64_t)run_blocks * block_size >= file_size);
+        if (last || nextEntry != fatEntry + 1) {
+            uint64_t run_bytes = (uint64_t)run_blocks * block_size;
+            uint32_t write_size = (file_size < run_bytes) ? file_size : (uint32_t)run_bytes;
+
+            // Use write system call to write to the file
+            if (write(fd, file + (size_t)run_start * block_size, write_size) == -1) {
+                perror("write");
+                close(fd);
+                exit(EXIT_FAILURE);
+            }
+
+            // Update the remaining file size
+            file_size -= write_size;
+            run_start = nextEntry;
+            run_blocks = 0;
+        }
+
+        // Break if the FAT entry is invalid or indicates the end of the file
+        if (nextEntry > 0xFFFFFF00) {
+            break;
+        }
+        fatEntry = nextEntry;
+    }
+}
+
 void printFileContent(const char* output_filename, char* file, int file_size, int block_size, int block_start, int block_count, uint32_t* fatPtr) {
     // Open the file using open system call
     int fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
@@ -52,35 +128,227 @@ void printFileContent(const char* output_filename, char* file, int file_size, in
         exit(EXIT_FAILURE);
     }
 
-    uint32_t fatEntry = block_start;
-    for (uint32_t j = 0; j < block_count && file_size > 0; j++) {
-        // Get a pointer to the current block
-        void* block = file + fatEntry * block_size;
+#ifdef SPECIALIZE_BLOCK_SIZES
+    switch (block_size) {
+        case 512:
+            copyBlockChain(fd, file, file_size, 512, block_start, block_count, fatPtr);
+            break;
+        case 1024:
+            copyBlockChain(fd, file, file_size, 1024, block_start, block_count, fatPtr);
+            break;
+        case 4096:
+            copyBlockChain(fd, file, file_size, 4096, block_start, block_count, fatPtr);
+            break;
+        default:
+            copyBlockChain(fd, file, file_size, block_size, block_start, block_count, fatPtr);
+            break;
+    }
+#else
+    copyBlockChain(fd, file, file_size, block_size, block_start, block_count, fatPtr);
+#endif
+
+    // Close the file
+    close(fd);
+}
 
-        // Determine how much to write from the current block
-        int write_size = (file_size < block_size) ? file_size : block_size;
+// Function to copy length bytes starting at a stored offset of a file out of its blocks
+int readStoredBytes(struct ChunkReader* reader, uint64_t offset, uint32_t length, char* dst) {
+    while (length > 0) {
+        uint64_t index = offset / reader->block_size;
+        uint32_t within = offset % reader->block_size;
+        if (index >= reader->block_total) {
+            return 0;
+        }
+        uint32_t part = reader->block_size - within;
+        if (part > length) {
+            part = length;
+        }
+        memcpy(dst, reader->file + (size_t)reader->blocks[index] * reader->block_size + within, part);
+        dst += part;
+        offset += part;
+        length -= part;
+    }
+    return 1;
+}
 
-        // Use write system call to write to the file
-        if (write(fd, block, write_size) == -1) {
-            perror("write");
-            close(fd);
-            exit(EXIT_FAILURE);
+// Function to write a whole decompressed chunk, at its offset when the output can seek
+// Returns 0 and leaves errno set if the write fails
+int writeChunk(struct ChunkReader* reader, const char* chunk, uint32_t length, off_t offset) {
+    uint32_t written = 0;
+    while (written < length) {
+        ssize_t result = reader->seekable
+            ? pwrite(reader->output_fd, chunk + written, length - written, offset + written)
+            : write(reader->output_fd, chunk + written, length - written);
+        if (result == -1 && errno == EINTR) {
+            continue;
         }
+        if (result <= 0) {
+            if (result == 0) {
+                errno = EIO;
+            }
+            return 0;
+        }
+        written += result;
+    }
+    return 1;
+}
 
-        // Update the remaining file size
-        file_size -= write_size;
+// Function run by each decompression thread: claim chunks until none are left
+void* decompressChunks(void* arg) {
+    struct ChunkReader* reader = (struct ChunkReader*)arg;
+    char* compressed = (char*)malloc(lzBound(reader->chunk_size));
+    char* chunk = (char*)malloc(reader->chunk_size);
+    if (!compressed || !chunk) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
 
-        // Check the FAT entry for the next block
-        fatEntry = ntohl(*(fatPtr + fatEntry));
+    for (;;) {
+        uint32_t c = __atomic_fetch_add(&reader->next_chunk, 1, __ATOMIC_RELAXED);
+        if (c >= reader->chunk_count || __atomic_load_n(&reader->failed, __ATOMIC_RELAXED) != READER_OK) {
+            break;
+        }
 
-        // Break if the FAT entry is invalid or indicates the end of the file
-        if (fatEntry > 0xFFFFFF00) {
+        uint32_t expected = (reader->size - (uint64_t)c * reader->chunk_size < reader->chunk_size) ? reader->size - c * reader->chunk_size : reader->chunk_size;
+        uint32_t length = reader->table[c].length & ~CHUNK_STORED;
+        int stored = (reader->table[c].length & CHUNK_STORED) != 0;
+        int64_t produced = -1;
+        if (length <= lzBound(reader->chunk_size)
+            && readStoredBytes(reader, (uint64_t)reader->data_start + reader->table[c].offset, length, compressed)) {
+            if (stored) {
+                memcpy(chunk, compressed, length);
+                produced = length;
+            } else {
+                produced = lzDecompress((const uint8_t*)compressed, length, (uint8_t*)chunk, reader->chunk_size);
+            }
+        }
+        if (produced != expected) {
+            __atomic_store_n(&reader->failed, READER_CORRUPT, __ATOMIC_RELAXED);
             break;
         }
+        if (!writeChunk(reader, chunk, expected, (off_t)c * reader->chunk_size)) {
+            reader->write_errno = errno;
+            __atomic_store_n(&reader->failed, READER_WRITE_FAILED, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    free(compressed);
+    free(chunk);
+    return NULL;
+}
+
+// Function to copy a compressed file out of the image, decompressing its chunks in parallel
+void printCompressedContent(const char* output_filename, char* file, int file_size, int block_size, int block_start, int block_count, uint32_t* fatPtr) {
+    struct ChunkReader reader;
+    memset(&reader, 0, sizeof(struct ChunkReader));
+    reader.file = file;
+    reader.block_size = block_size;
+    reader.size = file_size;
+
+    // Collect the block chain so any stored offset maps straight to a block
+    reader.blocks = (uint32_t*)malloc((block_count > 0 ? block_count : 1) * sizeof(uint32_t));
+    if (!reader.blocks) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t fatEntry = block_start;
+    while (reader.block_total < block_count && fatEntry <= 0xFFFFFF00) {
+        reader.blocks[reader.block_total++] = fatEntry;
+        fatEntry = ntohl(*(fatPtr + fatEntry));
+    }
+
+    // Read the header and the chunk table
+    struct CompressedHeader header;
+    if (!readStoredBytes(&reader, 0, sizeof(struct CompressedHeader), (char*)&header)
+        || ntohl(header.magic) != COMPRESSED_MAGIC || ntohl(header.size) != reader.size
+        || ntohl(header.chunk_size) == 0 || ntohl(header.chunk_size) > (1 << 24)) {
+        printf("Error: Compressed file is corrupt.\n");
+        exit(EXIT_FAILURE);
+    }
+    reader.chunk_size = ntohl(header.chunk_size);
+    reader.chunk_count = ntohl(header.chunk_count);
+    if (reader.chunk_count != (reader.size + (uint64_t)reader.chunk_size - 1) / reader.chunk_size) {
+        printf("Error: Compressed file is corrupt.\n");
+        exit(EXIT_FAILURE);
+    }
+    reader.data_start = sizeof(struct CompressedHeader) + reader.chunk_count * sizeof(struct ChunkEntry);
+    reader.table = (struct ChunkEntry*)malloc((reader.chunk_count + 1) * sizeof(struct ChunkEntry));
+    if (!reader.table) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (!readStoredBytes(&reader, sizeof(struct CompressedHeader), reader.chunk_count * sizeof(struct ChunkEntry), (char*)reader.table)) {
+        printf("Error: Compressed file is corrupt.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t c = 0; c < reader.chunk_count; c++) {
+        reader.table[c].offset = ntohl(reader.table[c].offset);
+        reader.table[c].length = ntohl(reader.table[c].length);
+    }
+
+    // Open the file using open system call
+    reader.output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (reader.output_fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    // Each thread claims chunks and writes them at their own offset; a pipe or
+    // terminal cannot seek, so one thread decompresses and writes them in order
+    reader.seekable = lseek(reader.output_fd, 0, SEEK_CUR) != -1;
+    int thread_count = reader.seekable ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if (thread_count > MAX_DECOMPRESS_THREADS) {
+        thread_count = MAX_DECOMPRESS_THREADS;
+    }
+    if (thread_count > (int)reader.chunk_count) {
+        thread_count = reader.chunk_count;
+    }
+    pthread_t threads[MAX_DECOMPRESS_THREADS];
+    for (int i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[i], NULL, decompressChunks, &reader) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    decompressChunks(&reader);
+    for (int i = 1; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (reader.failed == READER_WRITE_FAILED) {
+        errno = reader.write_errno;
+        perror("write");
+        exit(EXIT_FAILURE);
     }
+    if (reader.failed == READER_CORRUPT) {
+        printf("Error: Compressed file is corrupt.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(reader.table);
+    free(reader.blocks);
 
     // Close the file
-    close(fd);
+    close(reader.output_fd);
+}
+
+// Function to copy out the file whose directory entry is at dirPtr
+// A file entry may be replaced by diskput, so read it and its blocks under a
+// shared lock on its slot; the writer frees the old chain only under the same slot
+void getFile(int fd, char* file, struct dir_entry_t* dirPtr, const char* output_filename, int block_size, uint32_t* fatPtr) {
+    off_t slot_offset = (char*)dirPtr - file;
+    lockRange(fd, F_RDLCK, slot_offset, sizeof(struct dir_entry_t));
+    struct dir_entry_t dirEntry = *dirPtr; // Create a copy of the data
+    dirEntry.size = ntohl(dirEntry.size);
+    dirEntry.starting_block = ntohl(dirEntry.starting_block);
+    dirEntry.block_count = ntohl(dirEntry.block_count);
+    if (dirEntry.status & STATUS_COMPRESSED) {
+        printCompressedContent(output_filename, file, dirEntry.size, block_size, dirEntry.starting_block, dirEntry.block_count, fatPtr);
+    } else {
+        printFileContent(output_filename, file, dirEntry.size, block_size, dirEntry.starting_block, dirEntry.block_count, fatPtr);
+    }
+    unlockRange(fd, slot_offset, sizeof(struct dir_entry_t));
 }
 
 
@@ -96,8 +364,8 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
     char* output_filename = argv[3];
-    // Open the file system image
-    int fd = open(argv[1], O_RDWR);
+    // Open the file system image read-only; readers only take shared locks
+    int fd = open(argv[1], O_RDONLY);
     if (fd == -1) {
         perror("open");
         exit(EXIT_FAILURE);
@@ -108,7 +376,7 @@ int main(int argc, char* argv[]) {
     int size = buffer.st_size;
 
     // Map the file system image into memory
-    char* file = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    char* file = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
     if (file == MAP_FAILED) {
         perror("mmap");
         exit(EXIT_FAILURE);
@@ -127,6 +395,28 @@ int main(int argc, char* argv[]) {
     uint32_t* fatPtr = (uint32_t*)(file + superBlock.fat_starts * superBlock.block_size);
 
 
+    // Resolve the whole path with one probe of the path index, rebuilding it if it is stale
+    char fullPath[INDEX_MAX_PATH];
+    struct PathIndex index;
+    if (normalizePath(argv[2], fullPath, sizeof(fullPath))) {
+        if (!openPathIndex(argv[1], fd, file, 0, &index)) {
+            buildPathIndex(argv[1], fd, file, size);
+            openPathIndex(argv[1], fd, file, 0, &index);
+        }
+        if (index.map != NULL) {
+            const struct IndexEntry* entry = lookupPath(&index, fullPath);
+            char* dirEntry = entry ? resolveIndexEntry(file, size, superBlock.block_size, entry, strrchr(fullPath, '/') + 1) : NULL;
+            closePathIndex(&index);
+            if (dirEntry != NULL && IS_FILE_STATUS(dirEntry[DIR_ENTRY_STATUS])) {
+                getFile(fd, file, (struct dir_entry_t*)dirEntry, output_filename, superBlock.block_size, fatPtr);
+                munmap(file, size);
+                close(fd);
+                return 0;
+            }
+        }
+    }
+
+    // Otherwise walk the path one directory at a time
     char* subDir = argv[2];
     char* token = (char*)strtok(subDir, "/");
     int block_start = superBlock.root_dir_starts;
@@ -138,25 +428,16 @@ int main(int argc, char* argv[]) {
         int found = 0;
         //toUpperCase(token); // Convert the token to uppercase
         for (int i = 0; i < block_count * superBlock.block_size / sizeof(struct dir_entry_t); i++) {
-            struct dir_entry_t dirEntry = *dirPtr; // Create a copy of the data
-            dirEntry.size = ntohl(dirEntry.size);
-            dirEntry.starting_block = ntohl(dirEntry.starting_block);
-            dirEntry.block_count = ntohl(dirEntry.block_count);
-            dirEntry.create_time.year = ntohs(dirEntry.create_time.year);
-            dirEntry.modify_time.year = ntohs(dirEntry.modify_time.year);
-            // Check if the filename matches after converting both to uppercase
-            if (dirEntry.status == 0x05 && strcmp((const char*)dirEntry.filename, token) == 0) {
-                block_start = dirEntry.starting_block;
-                block_count = dirEntry.block_count;
+            // Only the matching entry is converted to host byte order
+            if (dirPtr->status == 0x05 && strcmp((const char*)dirPtr->filename, token) == 0) {
+                block_start = ntohl(dirPtr->starting_block);
+                block_count = ntohl(dirPtr->block_count);
                 found = 1;
                 break;
-            } else if (dirEntry.status == 0x03 && strcmp((const char*)dirEntry.filename, token) == 0) {
+            } else if (IS_FILE_STATUS(dirPtr->status) && strcmp((const char*)dirPtr->filename, token) == 0) {
                 // If it's the last token, print the content of the specified file
-                file_size = dirEntry.size;
-                block_start = dirEntry.starting_block;
-                block_count = dirEntry.block_count;
                 if (strtok(NULL, "/") == NULL) {
-                    printFileContent(output_filename, file, file_size, superBlock.block_size, block_start, block_count, fatPtr);
+                    getFile(fd, file, dirPtr, output_filename, superBlock.block_size, fatPtr);
                     munmap(file, size);
                     close(fd);
                     return 0;
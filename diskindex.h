@@ -0,0 +1,463 @@
+#ifndef DISKINDEX_H
+#define DISKINDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "diskalloc.h"
+#include "disklock.h"
+
+// Memory-mapped path index kept in a sidecar file next to the image
+//
+// The sidecar <image>.index maps every full path ("/subdir1/foo.txt") to the
+// directory block and slot of its entry. Paths are hashed into an open-addressed table, so
+// resolving a path is one probe into a shared read-only mapping instead of a
+// directory scan per component.
+//
+// The index is a cache. It carries the same ImageStamp as the allocation
+// summary and is ignored when the stamp no longer matches the image. A hit is
+// only a locator: callers check that the slot it names still holds an entry
+// with that name before trusting it, and walk the tree otherwise. diskput
+// appends to the index in place and restamps it after each write. A tool that
+// finds it stale or missing rebuilds it from the directory tree, unless another
+// process already is, in which case it just walks the tree this time.
+
+#define INDEX_MAGIC "SFSINDEX"
+#define INDEX_VERSION 2
+
+// Directory entry layout in the image
+#define DIR_ENTRY_LENGTH 64
+#define DIR_ENTRY_STATUS 0
+#define DIR_ENTRY_STARTING_BLOCK 1
+#define DIR_ENTRY_BLOCK_COUNT 5
+#define DIR_ENTRY_FILENAME 27
+#define DIR_ENTRY_FILENAME_LENGTH 31
+
+#define INDEX_MAX_PATH 4096
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+    uint32_t bucket_count;     // power of two, kept at most three-quarters full
+    uint32_t string_used;
+    uint32_t string_capacity;
+    struct ImageStamp stamp;
+};
+
+struct IndexEntry {
+    uint32_t hash;
+    uint32_t path_offset;
+    uint32_t dir_block;        // block holding the directory entry
+    uint16_t slot;             // entry number within that block
+    uint16_t path_length;
+    uint8_t status;
+    uint8_t unused[3];
+};
+
+// A mapped index: buckets hold an entry number plus one, or 0 when empty
+struct PathIndex {
+    char* map;
+    size_t map_size;
+    struct IndexHeader* header;
+    uint32_t* buckets;
+    struct IndexEntry* entries;
+    char* strings;
+};
+
+static inline void indexPath(const char* image, char* path, size_t length) {
+    snprintf(path, length, "%s.index", image);
+}
+
+// Function to write path in the index's form: one leading slash, no empty components
+// Returns 0 if it does not fit
+static inline int normalizePath(const char* path, char* normalized, size_t length) {
+    size_t used = 0;
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        size_t component = strcspn(path, "/");
+        if (component == 0) {
+            break;
+        }
+        if (used + 1 + component + 1 > length) {
+            return 0;
+        }
+        normalized[used++] = '/';
+        memcpy(normalized + used, path, component);
+        used += component;
+        path += component;
+    }
+    if (used == 0) {
+        if (length < 2) {
+            return 0;
+        }
+        normalized[used++] = '/';
+    }
+    normalized[used] = '\0';
+    return 1;
+}
+
+// Function to hash a full path (FNV-1a)
+static inline uint32_t hashPath(const char* path, size_t length) {
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)path[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static inline size_t indexFileSize(uint32_t bucket_count, uint32_t entry_capacity, uint32_t string_capacity) {
+    return sizeof(struct IndexHeader) + (size_t)bucket_count * sizeof(uint32_t)
+        + (size_t)entry_capacity * sizeof(struct IndexEntry) + string_capacity;
+}
+
+// Function to point the section pointers of an index at its mapping
+static inline int attachPathIndex(struct PathIndex* index, char* map, size_t map_size) {
+    struct IndexHeader* header = (struct IndexHeader*)map;
+    if (map_size < sizeof(struct IndexHeader) || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+        || header->version != INDEX_VERSION || header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1)) != 0
+        || header->entry_count > header->entry_capacity || header->string_used > header->string_capacity
+        || indexFileSize(header->bucket_count, header->entry_capacity, header->string_capacity) != map_size) {
+        return 0;
+    }
+    index->map = map;
+    index->map_size = map_size;
+    index->header = header;
+    index->buckets = (uint32_t*)(map + sizeof(struct IndexHeader));
+    index->entries = (struct IndexEntry*)(index->buckets + header->bucket_count);
+    index->strings = (char*)(index->entries + header->entry_capacity);
+    return 1;
+}
+
+static inline void closePathIndex(struct PathIndex* index) {
+    if (index->map != NULL) {
+        munmap(index->map, index->map_size);
+        index->map = NULL;
+    }
+}
+
+// Function to map the index read-only, or read-write for diskput
+// Returns 1 if the index exists and matches the image
+static inline int openPathIndex(const char* image, int fd, const char* file, int writable, struct PathIndex* index) {
+    char path[INDEX_MAX_PATH];
+    indexPath(image, path, sizeof(path));
+    memset(index, 0, sizeof(struct PathIndex));
+
+    int index_fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (index_fd == -1) {
+        return 0;
+    }
+    struct stat buffer;
+    fstat(index_fd, &buffer);
+    if (buffer.st_size < (off_t)sizeof(struct IndexHeader)) {
+        close(index_fd);
+        return 0;
+    }
+    char* map = mmap(NULL, buffer.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, index_fd, 0);
+    close(index_fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    if (!attachPathIndex(index, map, buffer.st_size) || !imageStampMatches(&index->header->stamp, fd, file)) {
+        munmap(map, buffer.st_size);
+        index->map = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Function to find a full path in the index; returns NULL if it is not there
+static inline const struct IndexEntry* lookupPath(const struct PathIndex* index, const char* path) {
+    size_t length = strlen(path);
+    uint32_t hash = hashPath(path, length);
+    uint32_t mask = index->header->bucket_count - 1;
+    uint32_t entry_count = __atomic_load_n(&index->header->entry_count, __ATOMIC_ACQUIRE);
+
+    for (uint32_t b = hash & mask, probes = 0; probes <= mask; b = (b + 1) & mask, probes++) {
+        uint32_t slot = __atomic_load_n(&index->buckets[b], __ATOMIC_ACQUIRE);
+        if (slot == 0) {
+            return NULL;
+        }
+        if (slot > entry_count) {
+            continue; // Published after we read the count
+        }
+        const struct IndexEntry* entry = &index->entries[slot - 1];
+        if (entry->hash == hash && entry->path_length == length
+            && (uint64_t)entry->path_offset + length <= index->header->string_used
+            && memcmp(index->strings + entry->path_offset, path, length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Function to locate the directory entry an index hit names in the image
+// Returns NULL unless the slot still holds an entry called name of the same kind
+static inline char* resolveIndexEntry(char* file, size_t image_size, uint32_t block_size, const struct IndexEntry* entry, const char* name) {
+    uint64_t offset = (uint64_t)entry->dir_block * block_size + (uint64_t)entry->slot * DIR_ENTRY_LENGTH;
+    if (entry->slot >= block_size / DIR_ENTRY_LENGTH || offset + DIR_ENTRY_LENGTH > image_size) {
+        return NULL;
+    }
+    char* dirEntry = file + offset;
+    uint8_t status = dirEntry[DIR_ENTRY_STATUS];
+    if (status == 0x00 || ((status ^ entry->status) & 0x07) != 0) {
+        return NULL;
+    }
+    if (strncmp(dirEntry + DIR_ENTRY_FILENAME, name, DIR_ENTRY_FILENAME_LENGTH) != 0) {
+        return NULL;
+    }
+    return dirEntry;
+}
+
+// Function to add or refresh the index entry for the directory entry at entry_offset
+// Returns 0 if the index is full and has to be rebuilt
+static inline int updateIndexEntry(struct PathIndex* index, const char* path, const char* file, uint32_t block_size, uint64_t entry_offset) {
+    struct IndexHeader* header = index->header;
+    size_t length = strlen(path);
+    uint32_t hash = hashPath(path, length);
+    uint32_t mask = header->bucket_count - 1;
+
+    // Find the path's bucket, or the empty bucket it belongs in
+    uint32_t b = hash & mask;
+    struct IndexEntry* entry = NULL;
+    for (uint32_t probes = 0; probes <= mask; b = (b + 1) & mask, probes++) {
+        uint32_t slot = index->buckets[b];
+        if (slot == 0) {
+            break;
+        }
+        struct IndexEntry* candidate = &index->entries[slot - 1];
+        if (candidate->hash == hash && candidate->path_length == length && memcmp(index->strings + candidate->path_offset, path, length) == 0) {
+            entry = candidate;
+            break;
+        }
+    }
+    if (entry == NULL) {
+        if (index->buckets[b] != 0 || header->entry_count == header->entry_capacity || header->string_used + length > header->string_capacity) {
+            return 0;
+        }
+        entry = &index->entries[header->entry_count];
+        memcpy(index->strings + header->string_used, path, length);
+        entry->hash = hash;
+        entry->path_offset = header->string_used;
+        entry->path_length = length;
+        header->string_used += length;
+    }
+
+    entry->dir_block = entry_offset / block_size;
+    entry->slot = (entry_offset % block_size) / DIR_ENTRY_LENGTH;
+    entry->status = file[entry_offset + DIR_ENTRY_STATUS];
+
+    // Publish a new entry: the entry itself, then the count, then its bucket
+    if (index->buckets[b] == 0) {
+        __atomic_store_n(&header->entry_count, header->entry_count + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&index->buckets[b], header->entry_count, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+// Function to record that the index matches the image as it is now
+// Other processes see the shared mapping through the page cache, and a lost
+// index is only rebuilt, so it is not synced to disk
+static inline void restampPathIndex(struct PathIndex* index, int fd, const char* file) {
+    stampImage(&index->header->stamp, fd, file);
+}
+
+// A directory still to be indexed during a rebuild
+struct IndexWalk {
+    uint32_t block_start;
+    uint32_t block_count;
+    uint32_t path_length;
+    uint32_t path_offset;      // into the walk's own path buffer
+};
+
+// Function to rebuild the index from the directory tree and replace the sidecar
+// Only one process rebuilds at a time: the others return at once and walk the
+// tree. The sidecar is only a cache, so failing to write it is not an error
+static inline void buildPathIndex(const char* image, int fd, const char* file, size_t image_size) {
+    uint16_t raw_block_size;
+    uint32_t raw_value;
+    memcpy(&raw_block_size, file + 8, sizeof(uint16_t));
+    uint32_t block_size = ntohs(raw_block_size);
+    memcpy(&raw_value, file + 10, sizeof(uint32_t));
+    uint32_t block_count = ntohl(raw_value);
+    memcpy(&raw_value, file + 22, sizeof(uint32_t));
+    uint32_t root_dir_starts = ntohl(raw_value);
+    memcpy(&raw_value, file + 26, sizeof(uint32_t));
+    uint32_t root_dir_blocks = ntohl(raw_value);
+    if (block_size < DIR_ENTRY_LENGTH || (uint64_t)block_count * block_size > image_size) {
+        return;
+    }
+
+    // Take the rebuild lock, or leave the rebuild to whoever holds it
+    char path[INDEX_MAX_PATH];
+    char lock_path[INDEX_MAX_PATH + 32];
+    char temp_path[INDEX_MAX_PATH + 32];
+    indexPath(image, path, sizeof(path));
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT, 0666);
+    if (lock_fd == -1) {
+        return;
+    }
+    if (!tryLockRange(lock_fd, F_WRLCK, 0, 0)) {
+        close(lock_fd);
+        return;
+    }
+
+    // The previous holder may have just rebuilt it
+    struct PathIndex current;
+    if (openPathIndex(image, fd, file, 0, &current)) {
+        closePathIndex(&current);
+        close(lock_fd);
+        return;
+    }
+
+    // Stamp before walking, so a write that races the walk leaves the index stale
+    struct ImageStamp stamp;
+    stampImage(&stamp, fd, file);
+
+    // First pass: collect every entry's path and location
+    uint8_t* visited = (uint8_t*)calloc(block_count, 1);
+    size_t walk_capacity = 64, walk_count = 0;
+    struct IndexWalk* walk = (struct IndexWalk*)malloc(walk_capacity * sizeof(struct IndexWalk));
+    size_t found_capacity = 1024, found_count = 0;
+    uint64_t* found = (uint64_t*)malloc(found_capacity * sizeof(uint64_t));
+    size_t path_capacity = 65536, path_used = 1;
+    char* paths = (char*)malloc(path_capacity);
+    uint32_t* found_paths = (uint32_t*)malloc(found_capacity * 2 * sizeof(uint32_t));
+    if (!visited || !walk || !found || !paths || !found_paths) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    paths[0] = '\0';
+    walk[walk_count++] = (struct IndexWalk){root_dir_starts, root_dir_blocks, 0, 0};
+
+    while (walk_count > 0) {
+        struct IndexWalk dir = walk[--walk_count];
+        if (dir.block_start >= block_count || dir.block_count > block_count - dir.block_start || visited[dir.block_start]) {
+            continue;
+        }
+        for (uint32_t b = 0; b < dir.block_count; b++) {
+            visited[dir.block_start + b] = 1;
+        }
+
+        for (uint64_t i = 0; i < (uint64_t)dir.block_count * block_size / DIR_ENTRY_LENGTH; i++) {
+            uint64_t entry_offset = (uint64_t)dir.block_start * block_size + i * DIR_ENTRY_LENGTH;
+            const char* dirEntry = file + entry_offset;
+            uint8_t status = dirEntry[DIR_ENTRY_STATUS];
+            if ((status & 0x07) != 0x03 && status != 0x05) {
+                continue;
+            }
+            size_t name_length = strnlen(dirEntry + DIR_ENTRY_FILENAME, DIR_ENTRY_FILENAME_LENGTH);
+            size_t length = dir.path_length + 1 + name_length;
+            if (length >= INDEX_MAX_PATH) {
+                continue;
+            }
+
+            // Store the full path, then remember where it is
+            while (path_used + length + 1 > path_capacity) {
+                path_capacity *= 2;
+                paths = (char*)realloc(paths, path_capacity);
+                if (!paths) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            uint32_t path_offset = path_used;
+            memcpy(paths + path_offset, paths + dir.path_offset, dir.path_length);
+            paths[path_offset + dir.path_length] = '/';
+            memcpy(paths + path_offset + dir.path_length + 1, dirEntry + DIR_ENTRY_FILENAME, name_length);
+            paths[path_offset + length] = '\0';
+            path_used += length + 1;
+
+            if (found_count == found_capacity) {
+                found_capacity *= 2;
+                found = (uint64_t*)realloc(found, found_capacity * sizeof(uint64_t));
+                found_paths = (uint32_t*)realloc(found_paths, found_capacity * 2 * sizeof(uint32_t));
+                if (!found || !found_paths) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            found[found_count] = entry_offset;
+            found_paths[found_count * 2] = path_offset;
+            found_paths[found_count * 2 + 1] = length;
+            found_count++;
+
+            if (status == 0x05) {
+                if (walk_count == walk_capacity) {
+                    walk_capacity *= 2;
+                    walk = (struct IndexWalk*)realloc(walk, walk_capacity * sizeof(struct IndexWalk));
+                    if (!walk) {
+                        perror("realloc");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                uint32_t value;
+                memcpy(&value, dirEntry + DIR_ENTRY_STARTING_BLOCK, sizeof(uint32_t));
+                uint32_t child_start = ntohl(value);
+                memcpy(&value, dirEntry + DIR_ENTRY_BLOCK_COUNT, sizeof(uint32_t));
+                walk[walk_count++] = (struct IndexWalk){child_start, ntohl(value), length, path_offset};
+            }
+        }
+    }
+
+    // Second pass: size the table with an eighth to spare for diskput to append
+    // to, keep the buckets at most three-quarters full, and fill it in a new file
+    uint32_t entry_capacity = found_count + found_count / 8 + 256;
+    uint32_t bucket_count = 1;
+    while ((uint64_t)bucket_count * 3 < (uint64_t)entry_capacity * 4) {
+        bucket_count <<= 1;
+    }
+    uint32_t string_capacity = path_used + path_used / 8 + 4096;
+    size_t map_size = indexFileSize(bucket_count, entry_capacity, string_capacity);
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int index_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    char* map = MAP_FAILED;
+    if (index_fd != -1 && ftruncate(index_fd, map_size) == 0) {
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    }
+    if (map != MAP_FAILED) {
+        struct IndexHeader* header = (struct IndexHeader*)map;
+        memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+        header->version = INDEX_VERSION;
+        header->entry_capacity = entry_capacity;
+        header->bucket_count = bucket_count;
+        header->string_capacity = string_capacity;
+
+        struct PathIndex index;
+        attachPathIndex(&index, map, map_size);
+        for (size_t i = 0; i < found_count; i++) {
+            updateIndexEntry(&index, paths + found_paths[i * 2], file, block_size, found[i]);
+        }
+        header->stamp = stamp;
+        munmap(map, map_size);
+        if (rename(temp_path, path) == -1) {
+            unlink(temp_path);
+        }
+    } else if (index_fd != -1) {
+        unlink(temp_path);
+    }
+    if (index_fd != -1) {
+        close(index_fd);
+    }
+    close(lock_fd);
+
+    free(visited);
+    free(walk);
+    free(found);
+    free(found_paths);
+    free(paths);
+}
+
+#endif
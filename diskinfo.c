@@ -6,6 +6,9 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <arpa/inet.h>
+#include <string.h>
+#include "disklock.h"
+#include "diskalloc.h"
 
 
 // Define structures for the super block and FAT information
@@ -50,8 +53,8 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Open the file system image
-    int fd = open(argv[1], O_RDWR);
+    // Open the file system image read-only; readers only take shared locks
+    int fd = open(argv[1], O_RDONLY);
     if (fd == -1) {
         perror("open");
         exit(EXIT_FAILURE);
@@ -62,7 +65,7 @@ int main(int argc, char *argv[]) {
     int size = buffer.st_size;
 
     // Map the file system image into memory
-    char *file = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    char *file = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
     if (file == MAP_FAILED) {
         perror("mmap");
         exit(EXIT_FAILURE);
@@ -77,24 +80,26 @@ int main(int argc, char *argv[]) {
     superBlock.root_dir_starts = ntohl(*((uint32_t *)(file + 22)));
     superBlock.root_dir_blocks = ntohl(*((uint32_t *)(file + 26)));
 
-    // Read FAT information
-    uint32_t* fatPtr = (uint32_t*)(file + superBlock.fat_starts * superBlock.block_size);
-    struct FatInfo fatInfo;
-    fatInfo.free_blocks = 0;
-    fatInfo.reserved_blocks = 0;
-    fatInfo.allocated_blocks = 0;
-    uint32_t fatEntry;
-    for (int i = 0; i < superBlock.fat_blocks * superBlock.block_size / 4; i++) {
-        fatEntry = ntohl(*(fatPtr));
-        fatPtr++;
-        if (fatEntry == 0) {
-            fatInfo.free_blocks++;
-        } else if (fatEntry == 1) {
-            fatInfo.reserved_blocks++;
-        } else {
-            fatInfo.allocated_blocks++;
-        }
+    // Read FAT information from the allocation summary, rebuilding it if the image changed
+    uint32_t fat_entries = superBlock.fat_blocks * superBlock.block_size / sizeof(uint32_t);
+    struct AllocHeader header;
+    if (!loadAllocHeader(argv[1], fd, file, fat_entries, &header)) {
+        // Hold a shared lock on the FAT so a writer's chain updates are counted all or nothing
+        uint32_t* fatPtr = (uint32_t*)(file + superBlock.fat_starts * superBlock.block_size);
+        off_t fat_offset = (off_t)superBlock.fat_starts * superBlock.block_size;
+        off_t fat_length = (off_t)superBlock.fat_blocks * superBlock.block_size;
+        struct AllocSummary summary;
+        lockRange(fd, F_RDLCK, fat_offset, fat_length);
+        buildAllocSummary(fatPtr, fat_entries, &summary);
+        saveAllocSummary(argv[1], fd, file, &summary);
+        unlockRange(fd, fat_offset, fat_length);
+        header = summary.header;
+        freeAllocSummary(&summary);
     }
+    struct FatInfo fatInfo;
+    fatInfo.free_blocks = header.free_blocks;
+    fatInfo.reserved_blocks = header.reserved_blocks;
+    fatInfo.allocated_blocks = header.allocated_blocks;
 
     // Display information
     displaySuperBlockInfo(superBlock);
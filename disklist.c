@@ -7,6 +7,9 @@
 #include <sys/mman.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include "disklock.h"
+#include "diskcompress.h"
+#include "diskindex.h"
 
 struct __attribute__((__packed__)) dir_entry_timedate_t {
     uint16_t year;
@@ -37,9 +40,19 @@ struct __attribute__((__packed__)) SuperBlock {
     uint32_t root_dir_blocks;
 };
 
-void printList(char* file, int block_size, int block_start, int block_count, int arg_count, int argc) {
+void printList(int fd, char* file, int block_size, int block_start, int block_count, int arg_count, int argc) {
     struct dir_entry_t* dirPtr = (struct dir_entry_t*)(file + block_start * block_size);
+
+    // Hold a shared lock on the directory so an entry being replaced is never printed half-written
+    off_t dir_offset = (off_t)block_start * block_size;
+    off_t dir_length = (off_t)block_count * block_size;
+    lockRange(fd, F_RDLCK, dir_offset, dir_length);
     for (int i = 0; i < block_count * block_size / sizeof(struct dir_entry_t); i++) {
+        // Skip empty entries without converting them
+        if (!IS_FILE_STATUS(dirPtr->status) && dirPtr->status != 0x05) {
+            dirPtr++;
+            continue;
+        }
         struct dir_entry_t dirEntry = *dirPtr; // Create a copy of the data
 
         dirEntry.size = ntohl(dirEntry.size);
@@ -47,13 +60,14 @@ void printList(char* file, int block_size, int block_start, int block_count, int
         dirEntry.block_count = ntohl(dirEntry.block_count);
         dirEntry.create_time.year = ntohs(dirEntry.create_time.year);
         dirEntry.modify_time.year = ntohs(dirEntry.modify_time.year);
-        if (dirEntry.status == 0x03 && arg_count==argc) {
+        if (IS_FILE_STATUS(dirEntry.status) && arg_count==argc) {
             printf("F %10d %30s %04d/%02d/%02d %02d:%02d:%02d\n", dirEntry.size, dirEntry.filename, dirEntry.create_time.year, dirEntry.create_time.month, dirEntry.create_time.day, dirEntry.create_time.hour, dirEntry.create_time.minute, dirEntry.create_time.second);
         } else if (dirEntry.status == 0x05) {
             printf("D %10d %30s %04d/%02d/%02d %02d:%02d:%02d\n", dirEntry.size, dirEntry.filename, dirEntry.create_time.year, dirEntry.create_time.month, dirEntry.create_time.day, dirEntry.create_time.hour, dirEntry.create_time.minute, dirEntry.create_time.second);
         }
         dirPtr++;
     }
+    unlockRange(fd, dir_offset, dir_length);
 }
 
 int main(int argc, char *argv[]) {
@@ -62,8 +76,8 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Open the file system image
-    int fd = open(argv[1], O_RDWR);
+    // Open the file system image read-only; readers only take shared locks
+    int fd = open(argv[1], O_RDONLY);
     if (fd == -1) {
         perror("open");
         exit(EXIT_FAILURE);
@@ -74,7 +88,7 @@ int main(int argc, char *argv[]) {
     int size = buffer.st_size;
 
     // Map the file system image into memory
-    char *file = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    char *file = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
     if (file == MAP_FAILED) {
         perror("mmap");
         exit(EXIT_FAILURE);
@@ -92,28 +106,46 @@ int main(int argc, char *argv[]) {
     int arg_count = 0;
     if (argc == 2) {
         arg_count = 2;
-        printList(file, superBlock.block_size, superBlock.root_dir_starts, superBlock.root_dir_blocks, arg_count, argc);
+        printList(fd, file, superBlock.block_size, superBlock.root_dir_starts, superBlock.root_dir_blocks, arg_count, argc);
     }
     else{
         arg_count = 3;
-        char* subDir = argv[2];
-        char* token = (char*)strtok(subDir, "/");
         int block_start = superBlock.root_dir_starts;
         int block_count = superBlock.root_dir_blocks;
+        int indexed = 0;
+
+        // Resolve the directory with one probe of the path index, rebuilding it if it is stale
+        char fullPath[INDEX_MAX_PATH];
+        struct PathIndex index;
+        if (normalizePath(argv[2], fullPath, sizeof(fullPath)) && strcmp(fullPath, "/") != 0) {
+            if (!openPathIndex(argv[1], fd, file, 0, &index)) {
+                buildPathIndex(argv[1], fd, file, size);
+                openPathIndex(argv[1], fd, file, 0, &index);
+            }
+            if (index.map != NULL) {
+                const struct IndexEntry* entry = lookupPath(&index, fullPath);
+                struct dir_entry_t* dirPtr = entry ? (struct dir_entry_t*)resolveIndexEntry(file, size, superBlock.block_size, entry, strrchr(fullPath, '/') + 1) : NULL;
+                closePathIndex(&index);
+                if (dirPtr != NULL && dirPtr->status == 0x05) {
+                    block_start = ntohl(dirPtr->starting_block);
+                    block_count = ntohl(dirPtr->block_count);
+                    indexed = 1;
+                }
+            }
+        }
+
+        // Otherwise walk the path one directory at a time
+        char* subDir = argv[2];
+        char* token = indexed ? NULL : (char*)strtok(subDir, "/");
 
         while (token != NULL) {
             struct dir_entry_t* dirPtr = (struct dir_entry_t*)(file + block_start * superBlock.block_size);
             int found = 0;
             for (int i = 0; i < block_count * superBlock.block_size / sizeof(struct dir_entry_t); i++) {
-                struct dir_entry_t dirEntry = *dirPtr; // Create a copy of the data
-                dirEntry.size = ntohl(dirEntry.size);
-                dirEntry.starting_block = ntohl(dirEntry.starting_block);
-                dirEntry.block_count = ntohl(dirEntry.block_count);
-                dirEntry.create_time.year = ntohs(dirEntry.create_time.year);
-                dirEntry.modify_time.year = ntohs(dirEntry.modify_time.year);
-                if (dirEntry.status == 0x05 && strcmp((const char*)dirEntry.filename, token) == 0) {
-                    block_start = dirEntry.starting_block;
-                    block_count = dirEntry.block_count;
+                // Only the matching entry is converted to host byte order
+                if (dirPtr->status == 0x05 && strcmp((const char*)dirPtr->filename, token) == 0) {
+                    block_start = ntohl(dirPtr->starting_block);
+                    block_count = ntohl(dirPtr->block_count);
                     found = 1;
                     break;
                 }
@@ -125,7 +157,7 @@ int main(int argc, char *argv[]) {
             }
             token = strtok(NULL, "/");
         }
-        printList(file, superBlock.block_size, block_start, block_count, arg_count, argc);
+        printList(fd, file, superBlock.block_size, block_start, block_count, arg_count, argc);
     }
     // Unmap the file
     munmap(file, size);
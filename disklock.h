@@ -0,0 +1,81 @@
+#ifndef DISKLOCK_H
+#define DISKLOCK_H
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Byte-range locks shared by the disk tools
+//
+// diskput holds an exclusive lock on the superblock for its whole run, so there
+// is only ever one writer. Readers never touch that lock. The writer allocates
+// new blocks copy-on-write and only takes short exclusive locks on the FAT region
+// and on the directory slot it publishes; readers hold shared locks on the same
+// ranges while they read them, so they see either the old or the new file.
+//
+// Open file description locks are used where available so the locks belong to
+// the open image rather than the process; otherwise classic POSIX locks.
+
+#ifdef F_OFD_SETLKW
+#define DISK_SETLKW F_OFD_SETLKW
+#define DISK_SETLK F_OFD_SETLK
+#else
+#define DISK_SETLKW F_SETLKW
+#define DISK_SETLK F_SETLK
+#endif
+
+// Superblock byte range used as the single-writer token
+#define WRITER_LOCK_START 0
+#define WRITER_LOCK_LEN 30
+
+// Function to lock a byte range of the image, waiting until it is available
+// type is F_RDLCK for readers and F_WRLCK for the writer
+static inline void lockRange(int fd, short type, off_t start, off_t len) {
+    struct flock lock = {0};
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = len;
+    while (fcntl(fd, DISK_SETLKW, &lock) == -1) {
+        if (errno != EINTR) {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Function to lock a byte range without waiting; returns 0 if someone else holds it
+static inline int tryLockRange(int fd, short type, off_t start, off_t len) {
+    struct flock lock = {0};
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = len;
+    while (fcntl(fd, DISK_SETLK, &lock) == -1) {
+        if (errno == EAGAIN || errno == EACCES) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            perror("fcntl");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return 1;
+}
+
+// Function to release a byte range locked with lockRange
+static inline void unlockRange(int fd, off_t start, off_t len) {
+    struct flock lock = {0};
+    lock.l_type = F_UNLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = len;
+    if (fcntl(fd, DISK_SETLKW, &lock) == -1) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+#endif
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include "disklock.h"
+#include "diskalloc.h"
+#include "diskindex.h"
+#include "diskpatch.h"
+
+struct __attribute__((__packed__)) SuperBlock {
+    uint16_t block_size;
+    uint32_t block_count;
+    uint32_t fat_starts;
+    uint32_t fat_blocks;
+    uint32_t root_dir_starts;
+    uint32_t root_dir_blocks;
+};
+
+// Function to read the whole patch into memory so it can be checked before it is applied
+char* readPatch(const char* path, size_t* length) {
+    FILE* patch = fopen(path, "rb");
+    if (!patch) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    struct stat buffer;
+    fstat(fileno(patch), &buffer);
+    *length = buffer.st_size;
+    char* contents = (char*)malloc(*length + 1);
+    if (!contents) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (fread(contents, 1, *length, patch) != *length) {
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+    fclose(patch);
+    return contents;
+}
+
+// Function to check one record against the image geometry
+// Returns the payload length, or 0 if the record does not fit the image
+size_t recordPayloadLength(const struct PatchRecord* record, const struct SuperBlock* superBlock, uint32_t fat_entries) {
+    uint32_t block = ntohl(record->block);
+    uint32_t index = ntohl(record->index);
+    if (record->type == PATCH_BLOCK && block < superBlock->block_count) {
+        return superBlock->block_size;
+    } else if (record->type == PATCH_FAT && index < fat_entries) {
+        return sizeof(uint32_t);
+    } else if (record->type == PATCH_ENTRY && block < superBlock->block_count && index < superBlock->block_size / DIR_ENTRY_LENGTH) {
+        return DIR_ENTRY_LENGTH;
+    }
+    return 0;
+}
+
+// Function to check that a new superblock keeps the image's identifier and the
+// geometry the patch was checked against
+int keepsGeometry(const char* payload, const char* file, const struct SuperBlock* superBlock) {
+    return memcmp(payload, file, 8) == 0
+        && ntohs(*((uint16_t*)(payload + 8))) == superBlock->block_size
+        && ntohl(*((uint32_t*)(payload + 10))) == superBlock->block_count
+        && ntohl(*((uint32_t*)(payload + 14))) == superBlock->fat_starts
+        && ntohl(*((uint32_t*)(payload + 18))) == superBlock->fat_blocks;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        printf("Usage: %s <file_system_image> <patch_file>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Open the file system image
+    int fd = open(argv[1], O_RDWR);
+    if (fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    // A patch rewrites blocks that readers may be using, so take the whole image exclusively
+    lockRange(fd, F_WRLCK, 0, 0);
+
+    struct stat buffer;
+    fstat(fd, &buffer);
+    int size = buffer.st_size;
+
+    // Map the file system image into memory
+    char* file = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read super block information
+    struct SuperBlock superBlock;
+
+    superBlock.block_size = ntohs(*((uint16_t*)(file + 8)));
+    superBlock.block_count = ntohl(*((uint32_t*)(file + 10)));
+    superBlock.fat_starts = ntohl(*((uint32_t*)(file + 14)));
+    superBlock.fat_blocks = ntohl(*((uint32_t*)(file + 18)));
+    superBlock.root_dir_starts = ntohl(*((uint32_t*)(file + 22)));
+    superBlock.root_dir_blocks = ntohl(*((uint32_t*)(file + 26)));
+
+    uint32_t block_size = superBlock.block_size;
+    uint32_t* fatPtr = (uint32_t*)(file + superBlock.fat_starts * block_size);
+    uint32_t fat_entries = superBlock.fat_blocks * block_size / sizeof(uint32_t);
+
+    size_t patch_length;
+    char* patch = readPatch(argv[2], &patch_length);
+
+    // Check that the patch was made against this image
+    struct PatchHeader header;
+    if (patch_length < sizeof(struct PatchHeader)) {
+        printf("Error: Patch is truncated.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&header, patch, sizeof(struct PatchHeader));
+    if (memcmp(header.magic, PATCH_MAGIC, sizeof(header.magic)) != 0 || ntohl(header.version) != PATCH_VERSION) {
+        printf("Error: Not a patch file.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ntohs(header.block_size) != superBlock.block_size || ntohl(header.block_count) != superBlock.block_count
+        || ntohl(header.fat_starts) != superBlock.fat_starts || ntohl(header.fat_blocks) != superBlock.fat_blocks
+        || (uint64_t)superBlock.block_count * block_size > (uint64_t)size) {
+        printf("Error: Patch does not match the image geometry.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ntohll(header.base_fat_hash) != hashFat(fatPtr, fat_entries)) {
+        printf("Error: Patch was made against a different image.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // First pass: check every record before touching the image, so a truncated
+    // or corrupt patch leaves it unchanged
+    struct PatchRecord record;
+    size_t offset = sizeof(struct PatchHeader);
+    for (;;) {
+        if (patch_length - offset < sizeof(struct PatchRecord)) {
+            printf("Error: Patch is truncated.\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(&record, patch + offset, sizeof(struct PatchRecord));
+        offset += sizeof(struct PatchRecord);
+        if (record.type == PATCH_END) {
+            break;
+        }
+        size_t length = recordPayloadLength(&record, &superBlock, fat_entries);
+        if (length == 0) {
+            printf("Error: Patch is corrupt.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (patch_length - offset < length) {
+            printf("Error: Patch is truncated.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (record.type == PATCH_BLOCK && ntohl(record.block) == 0 && !keepsGeometry(patch + offset, file, &superBlock)) {
+            printf("Error: Patch changes the image geometry.\n");
+            exit(EXIT_FAILURE);
+        }
+        offset += length;
+    }
+    if (offset != patch_length) {
+        printf("Error: Patch is corrupt.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Second pass: apply the records in the order diskdiff wrote them
+    int applied = 0;
+    offset = sizeof(struct PatchHeader);
+    for (;;) {
+        memcpy(&record, patch + offset, sizeof(struct PatchRecord));
+        offset += sizeof(struct PatchRecord);
+        uint32_t block = ntohl(record.block);
+        uint32_t index = ntohl(record.index);
+
+        if (record.type == PATCH_END) {
+            break;
+        } else if (record.type == PATCH_BLOCK) {
+            memcpy(file + (size_t)block * block_size, patch + offset, block_size);
+        } else if (record.type == PATCH_FAT) {
+            memcpy(&fatPtr[index], patch + offset, sizeof(uint32_t));
+        } else {
+            memcpy(file + (size_t)block * block_size + index * DIR_ENTRY_LENGTH, patch + offset, DIR_ENTRY_LENGTH);
+        }
+        offset += recordPayloadLength(&record, &superBlock, fat_entries);
+        applied++;
+    }
+    free(patch);
+
+    msync(file, size, MS_SYNC);
+
+    // The allocation summary and path index no longer match the image
+    char path[4096];
+    allocPath(argv[1], path, sizeof(path));
+    unlink(path);
+    indexPath(argv[1], path, sizeof(path));
+    unlink(path);
+
+    printf("Patch applied: %d records.\n", applied);
+
+    unlockRange(fd, 0, 0);
+
+    // Unmap the file
+    munmap(file, size);
+
+    // Close the file
+    close(fd);
+
+    return 0;
+}
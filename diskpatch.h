@@ -0,0 +1,64 @@
+#ifndef DISKPATCH_H
+#define DISKPATCH_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+
+// Incremental patch format written by diskdiff and applied by diskpatch
+//
+// A patch turns one image (the base) into another with the same geometry. It
+// starts with a PatchHeader and is followed by records, each a PatchRecord and
+// its payload, ending with PATCH_END. Directory blocks are diffed one 64-byte
+// entry at a time, the FAT one entry at a time, and other allocated blocks whole.
+// All fields are big-endian like the image itself.
+
+#define PATCH_MAGIC "SFSPATCH"
+#define PATCH_VERSION 1
+
+enum PatchRecordType {
+    PATCH_END = 0,
+    PATCH_BLOCK = 1,    // payload: block_size bytes for block
+    PATCH_FAT = 2,      // payload: the raw FAT entry at index
+    PATCH_ENTRY = 3     // payload: the 64-byte directory entry at slot index of block
+};
+
+struct __attribute__((__packed__)) PatchHeader {
+    char magic[8];
+    uint32_t version;
+    uint16_t block_size;
+    uint32_t block_count;
+    uint32_t fat_starts;
+    uint32_t fat_blocks;
+    uint64_t base_fat_hash;     // the patch only applies to an image whose FAT has this hash
+};
+
+struct __attribute__((__packed__)) PatchRecord {
+    uint8_t type;
+    uint32_t block;
+    uint32_t index;
+};
+
+// Function to hash the FAT (FNV-1a over the entries in host order)
+static inline uint64_t hashFat(const uint32_t* fatPtr, uint32_t fat_entries) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < fat_entries; i++) {
+        hash ^= ntohl(fatPtr[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Convert a 64-bit value to and from the patch byte order
+static inline uint64_t htonll(uint64_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(value);
+#else
+    return value;
+#endif
+}
+
+static inline uint64_t ntohll(uint64_t value) {
+    return htonll(value);
+}
+
+#endif
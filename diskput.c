@@ -8,6 +8,10 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <time.h>
+#include "disklock.h"
+#include "diskalloc.h"
+#include "diskcompress.h"
+#include "diskindex.h"
 
 
 struct __attribute__((__packed__)) dir_entry_timedate_t {
@@ -39,47 +43,186 @@ struct __attribute__((__packed__)) SuperBlock {
     uint32_t root_dir_blocks;
 };
 
-void updateFileContent(char* file, int block_size, int block_start, int block_count, uint32_t* fatPtr, char* content, int content_size) {
-    uint32_t fatEntry = block_start;
-    int content_index = 0;
-    int file_size = content_size;
-
-    for (uint32_t j = 0; j < block_count && content_index < file_size; j++) {
-        // Get a pointer to the current block
-        void* block = file + fatEntry * block_size;
-        // Determine how much to write to the current block
-        int write_size = block_size;
-        if (file_size - content_index < block_size){
-            write_size = file_size - content_index;
-        }
-            
-        // Copy the content to the block
-        memcpy(block, content + content_index, write_size);
+// A run of consecutive blocks allocated for a new file
+struct BlockRun {
+    uint32_t start;
+    uint32_t count;
+};
+
+// Benchmark builds (make bench) compile the block write once per common block size
+// so it can be timed against the generic one; see bench.sh
+#ifdef SPECIALIZE_BLOCK_SIZES
+#define BLOCK_SIZE_INLINE static inline __attribute__((always_inline))
+#else
+#define BLOCK_SIZE_INLINE
+#endif
+
+// Function to copy content into a run of consecutive blocks
+BLOCK_SIZE_INLINE
+void writeBlockRun(char* file, uint32_t block_size, uint32_t block_start, uint32_t block_count, const char* content, uint32_t content_size) {
+    char* block = file + (size_t)block_start * block_size;
+    uint32_t content_index = 0;
+
+    // Copy the full blocks, then whatever is left into the final block
+    for (uint32_t j = 0; j < block_count && content_size - content_index >= block_size; j++) {
+        memcpy(block, content + content_index, block_size);
+        block += block_size;
+        content_index += block_size;
+    }
+    if (content_index < content_size) {
+        memcpy(block, content + content_index, content_size - content_index);
+    }
+}
+
+// Function to chain a run of consecutive blocks in the FAT, ending with next
+void linkBlockRun(uint32_t* fatPtr, uint32_t block_start, uint32_t block_count, uint32_t next) {
+    for (uint32_t i = 0; i + 1 < block_count; i++) {
+        fatPtr[block_start + i] = htonl(block_start + i + 1); // Point to the next block
+    }
+    fatPtr[block_start + block_count - 1] = htonl(next); // Next run, or 0xFFFFFFFF for the last block of the file
+}
+
+// Function to rebuild the allocation summary from the FAT
+// Used when the summary offers a block the FAT has in use, which means an older
+// tool wrote the image without changing anything the sidecar's stamp checks
+void rebuildAllocSummary(struct AllocSummary* summary, const uint32_t* fatPtr) {
+    uint32_t fat_entries = summary->header.fat_entries;
+    freeAllocSummary(summary);
+    buildAllocSummary(fatPtr, fat_entries, summary);
+}
+
+// Function to claim free blocks for a new file from the allocation summary
+// Each block is checked against the FAT before it is used; the FAT is not written
+// until the blocks are linked. Returns the number of runs stored in *runs, or -1
+// if there is not enough space
+int allocateBlocks(struct AllocSummary* summary, const uint32_t* fatPtr, uint32_t needed, struct BlockRun** runs) {
+    if (summary->header.free_blocks < needed) {
+        *runs = NULL;
+        return -1;
+    }
+
+    int run_count = 0;
+    int run_capacity = 16;
+    *runs = (struct BlockRun*)malloc(run_capacity * sizeof(struct BlockRun));
+    if (!*runs) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
 
-        // Update the FAT entry for the next block
-        if (j < block_count - 1) {
-            *(fatPtr + fatEntry) = htonl(fatEntry + 1); // Point to the next block
+    int64_t block = 0;
+    for (uint32_t found = 0; found < needed; found++) {
+        block = findFreeBlock(summary, block);
+        if (block == -1) {
+            printf("Error: Allocation summary is inconsistent with the FAT.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (fatPtr[block] != 0x00000000) {
+            // The summary is stale: rebuild it and start over
+            free(*runs);
+            rebuildAllocSummary(summary, fatPtr);
+            return allocateBlocks(summary, fatPtr, needed, runs);
+        }
+        markBlockAllocated(summary, block);
+        if (run_count > 0 && (*runs)[run_count - 1].start + (*runs)[run_count - 1].count == block) {
+            (*runs)[run_count - 1].count++;
         } else {
-            *(fatPtr + fatEntry) = htonl(0xFFFFFFFF); // Last block of the file
+            if (run_count == run_capacity) {
+                run_capacity *= 2;
+                *runs = (struct BlockRun*)realloc(*runs, run_capacity * sizeof(struct BlockRun));
+                if (!*runs) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            (*runs)[run_count].start = block;
+            (*runs)[run_count].count = 1;
+            run_count++;
         }
+    }
+    return run_count;
+}
 
-        // Update the remaining content size and index
-        content_size -= write_size;
+// Function to return a file's old block chain to the free list
+void freeBlockChain(uint32_t* fatPtr, uint32_t fat_entries, uint32_t block_start, struct AllocSummary* summary) {
+    uint32_t currentBlock = block_start;
+    while (currentBlock < fat_entries) {
+        uint32_t nextBlock = ntohl(*(fatPtr + currentBlock));
+        if (nextBlock == 0x00000000 || nextBlock == 0x00000001) {
+            break; // Not part of a chain
+        }
+        *(fatPtr + currentBlock) = htonl(0x00000000);
+        markBlockFree(summary, currentBlock);
+        currentBlock = nextBlock;
+    }
+}
+
+void updateFileContent(char* file, int block_size, struct BlockRun* runs, int run_count, char* content, int content_size) {
+    uint32_t content_index = 0;
+    for (int r = 0; r < run_count; r++) {
+        uint32_t run_bytes = runs[r].count * block_size;
+        uint32_t remaining = (content_index < content_size) ? content_size - content_index : 0;
+        uint32_t write_size = (remaining < run_bytes) ? remaining : run_bytes;
+
+#ifdef SPECIALIZE_BLOCK_SIZES
+        switch (block_size) {
+            case 512:
+                writeBlockRun(file, 512, runs[r].start, runs[r].count, content + content_index, write_size);
+                break;
+            case 1024:
+                writeBlockRun(file, 1024, runs[r].start, runs[r].count, content + content_index, write_size);
+                break;
+            case 4096:
+                writeBlockRun(file, 4096, runs[r].start, runs[r].count, content + content_index, write_size);
+                break;
+            default:
+                writeBlockRun(file, block_size, runs[r].start, runs[r].count, content + content_index, write_size);
+                break;
+        }
+#else
+        writeBlockRun(file, block_size, runs[r].start, runs[r].count, content + content_index, write_size);
+#endif
         content_index += write_size;
+    }
+}
 
-        // Check the FAT entry for the next block
-        fatEntry = ntohl(*(fatPtr + fatEntry));
+// Function to lay out content as a compressed file: header, chunk table, then chunks
+// Chunks that do not shrink are kept as they are; returns the stored length
+uint32_t compressContent(const char* content, uint32_t content_size, char** stored) {
+    uint32_t chunk_count = (content_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    uint32_t table_size = sizeof(struct CompressedHeader) + chunk_count * sizeof(struct ChunkEntry);
+    *stored = (char*)malloc(table_size + (uint64_t)chunk_count * lzBound(CHUNK_SIZE));
+    if (!*stored) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
 
-        // Break if the FAT entry is invalid or indicates the end of the file
-        if (ntohl(fatEntry) > 0xFFFFFF00) {
-            break;
+    struct CompressedHeader* header = (struct CompressedHeader*)*stored;
+    struct ChunkEntry* table = (struct ChunkEntry*)(*stored + sizeof(struct CompressedHeader));
+    header->magic = htonl(COMPRESSED_MAGIC);
+    header->chunk_size = htonl(CHUNK_SIZE);
+    header->chunk_count = htonl(chunk_count);
+    header->size = htonl(content_size);
+
+    uint32_t offset = 0;
+    for (uint32_t c = 0; c < chunk_count; c++) {
+        const uint8_t* chunk = (const uint8_t*)content + (size_t)c * CHUNK_SIZE;
+        uint32_t chunk_length = (content_size - c * CHUNK_SIZE < CHUNK_SIZE) ? content_size - c * CHUNK_SIZE : CHUNK_SIZE;
+        uint8_t* out = (uint8_t*)*stored + table_size + offset;
+        uint32_t length = lzCompress(chunk, chunk_length, out);
+        if (length >= chunk_length) {
+            memcpy(out, chunk, chunk_length);
+            length = chunk_length | CHUNK_STORED;
         }
+        table[c].offset = htonl(offset);
+        table[c].length = htonl(length);
+        offset += length & ~CHUNK_STORED;
     }
+    return table_size + offset;
 }
 
-
-void createNewFile(const char* fileToCopy, const char* filename, char* file, int block_size, int block_start, int block_count, uint32_t* fatPtr, int newFileSize, int fat_starts, int fat_blocks) {
-    // Find an empty entry in the directory
+// Returns the offset of the file's directory entry in the image
+off_t createNewFile(int fd, const char* fileToCopy, const char* filename, char* file, int block_size, int block_start, int block_count, uint32_t* fatPtr, int newFileSize, int fat_starts, int fat_blocks, struct AllocSummary* summary, int compress) {
+    // Find the existing entry for the file, or else the first empty entry in the directory
     int emptyEntryIndex = -1;
     struct dir_entry_t* dirPtr = (struct dir_entry_t*)(file + block_start * block_size);
     struct dir_entry_timedate_t original_create_time;
@@ -88,17 +231,16 @@ void createNewFile(const char* fileToCopy, const char* filename, char* file, int
     // Loop through the directory entries
     for (int i = 0; i < block_count*block_size/sizeof(struct dir_entry_t); i++) {
         // check if the file already exists
-        if (strcasecmp((const char*)dirPtr[i].filename, filename) == 0) {
-        emptyEntryIndex = i;
-        file_exists = 1;
-        original_create_time = dirPtr[emptyEntryIndex].create_time;
-        break;
-        }
-        // check if the entry is empty
-        if (dirPtr[i].status == 0x00) {
+        if (IS_FILE_STATUS(dirPtr[i].status) && strcasecmp((const char*)dirPtr[i].filename, filename) == 0) {
             emptyEntryIndex = i;
+            file_exists = 1;
+            original_create_time = dirPtr[emptyEntryIndex].create_time;
             break;
         }
+        // remember the first empty entry
+        if (dirPtr[i].status == 0x00 && emptyEntryIndex == -1) {
+            emptyEntryIndex = i;
+        }
     }
 
     if (emptyEntryIndex == -1) {
@@ -106,43 +248,67 @@ void createNewFile(const char* fileToCopy, const char* filename, char* file, int
         exit(EXIT_FAILURE);
     }
 
-    // Find unused sectors in the FAT
-    int unusedBlocks = 0;
-    int currentBlock = -1;
-    if (file_exists == 1){
-        currentBlock = ntohl(dirPtr[emptyEntryIndex].starting_block);
-        // free the old blocks
-        while (currentBlock != 0xFFFFFFFF) {
-            uint32_t nextBlock = ntohl(*(fatPtr + currentBlock));
-            *(fatPtr + currentBlock) = htonl(0x00000000);
-            currentBlock = nextBlock;
-        }
-        *(fatPtr + currentBlock) = htonl(0x00000000);// free the last block
+    // Get the content of the file
+    FILE* linuxFileForContent = fopen(fileToCopy, "r");
+    if (!linuxFileForContent) {
+        printf("File not found.\n");
+        exit(EXIT_FAILURE);
+    }
 
+    // Allocate memory for the content
+    char* content = (char*)malloc(newFileSize);
+    if (!content) {
+        perror("malloc");
+        fclose(linuxFileForContent);
+        exit(EXIT_FAILURE);
     }
-    for (int i = 0; i < fat_blocks * block_size / sizeof(uint32_t); i++) {
-        if (fatPtr[i] == 0x00000000) {
-            if (currentBlock == -1) {
-                currentBlock = i;
-            }
-            unusedBlocks++;
-        }
+
+    // Read the content from the file
+    fread(content, 1, newFileSize, linuxFileForContent);
+
+    // Close the file
+    fclose(linuxFileForContent);
+
+    // Compressed files store the chunk table and chunks instead of the raw content
+    char* stored = content;
+    uint32_t storedSize = newFileSize;
+    if (compress) {
+        storedSize = compressContent(content, newFileSize, &stored);
     }
-    
-    if (unusedBlocks < newFileSize / block_size + 1) {
+
+    // Find unused blocks in the FAT
+    // The old blocks stay in place until the new entry is published (copy-on-write),
+    // so a reader copying the old file never sees them change
+    uint32_t fat_entries = fat_blocks * block_size / sizeof(uint32_t);
+    uint32_t newBlockCount = storedSize / block_size + 1;
+    struct BlockRun* runs;
+    int run_count = allocateBlocks(summary, fatPtr, newBlockCount, &runs);
+    if (run_count == -1) {
         printf("Error: Not enough space on disk for the file.\n");
         exit(EXIT_FAILURE);
     }
 
+    // Write the content of the file to the new blocks, then chain them in the FAT
+    updateFileContent(file, block_size, runs, run_count, stored, storedSize);
+
+    off_t fat_offset = (off_t)fat_starts * block_size;
+    off_t fat_length = (off_t)fat_blocks * block_size;
+    lockRange(fd, F_WRLCK, fat_offset, fat_length);
+    for (int r = 0; r < run_count; r++) {
+        linkBlockRun(fatPtr, runs[r].start, runs[r].count, (r + 1 < run_count) ? runs[r + 1].start : 0xFFFFFFFF);
+    }
+    unlockRange(fd, fat_offset, fat_length);
+
     time_t t = time(NULL);
     struct tm tm = *localtime(&t);
 
     // Create a new entry for the file
     struct dir_entry_t newFileEntry;
     memset(&newFileEntry, 0, sizeof(struct dir_entry_t));
-    newFileEntry.status = 0x03; // Assume it's a file 
-    newFileEntry.starting_block = 0; // To be updated later
-    newFileEntry.block_count = 0;    // To be updated later
+    uint8_t status = compress ? STATUS_COMPRESSED_FILE : STATUS_FILE;
+    newFileEntry.status = status;
+    newFileEntry.starting_block = htonl(runs[0].start);
+    newFileEntry.block_count = htonl(newBlockCount);
     newFileEntry.size = htonl(newFileSize);
 
     newFileEntry.modify_time.year = htons(tm.tm_year + 1900);
@@ -158,45 +324,38 @@ void createNewFile(const char* fileToCopy, const char* filename, char* file, int
         newFileEntry.create_time = original_create_time;
     }
 
-    strncpy((char*)newFileEntry.filename, filename, 31);
+    strncpy((char*)newFileEntry.filename, filename, 30);
     
-    // Write the new entry back to the directory
-    dirPtr[emptyEntryIndex] = newFileEntry;
-
-    // Update the starting block and block count in the directory entry
-    dirPtr[emptyEntryIndex].starting_block = htonl(currentBlock);
-    dirPtr[emptyEntryIndex].block_count = htonl(newFileSize / block_size + 1);
-
-    // Get the content of the file
-    FILE* linuxFileForContent = fopen(fileToCopy, "r");
-    if (!linuxFileForContent) {
-        printf("File not found.\n");
-        exit(EXIT_FAILURE);
+    // Publish the new entry last
+    if (file_exists == 1) {
+        // Wait for readers of the old file, swap the entry and free the old blocks
+        off_t slot_offset = (char*)&dirPtr[emptyEntryIndex] - file;
+        lockRange(fd, F_WRLCK, slot_offset, sizeof(struct dir_entry_t));
+        uint32_t oldBlock = ntohl(dirPtr[emptyEntryIndex].starting_block);
+        dirPtr[emptyEntryIndex] = newFileEntry;
+        lockRange(fd, F_WRLCK, fat_offset, fat_length);
+        freeBlockChain(fatPtr, fat_entries, oldBlock, summary);
+        unlockRange(fd, fat_offset, fat_length);
+        unlockRange(fd, slot_offset, sizeof(struct dir_entry_t));
+    } else {
+        // Fill in the empty entry, then mark it as a file so readers never see it half-written
+        newFileEntry.status = 0x00;
+        dirPtr[emptyEntryIndex] = newFileEntry;
+        __atomic_store_n(&dirPtr[emptyEntryIndex].status, status, __ATOMIC_RELEASE);
     }
 
-    // Allocate memory for the content
-    char* content = (char*)malloc(newFileSize);
-    if (!content) {
-        perror("malloc");
-        fclose(linuxFileForContent);
-        exit(EXIT_FAILURE);
-    }
-
-    // Read the content from the file
-    fread(content, 1, newFileSize, linuxFileForContent);
-
-    // Close the file
-    fclose(linuxFileForContent);
-
-    // Write the content of the file to the FAT blocks
-    updateFileContent(file, block_size, currentBlock, newFileSize / block_size + 1, fatPtr, content, newFileSize);
-
     // Free the allocated memory
+    free(runs);
+    if (stored != content) {
+        free(stored);
+    }
     free(content);
 
+    return (char*)&dirPtr[emptyEntryIndex] - file;
 }
 
-int createDirectories(char* file, int block_size, int block_start, int block_count, uint32_t* fatPtr, const char* dirName, int fat_starts, int fat_blocks) {
+// Returns the new directory's starting block and sets entryOffset to its directory entry
+int createDirectories(int fd, char* file, int block_size, int block_start, int block_count, uint32_t* fatPtr, const char* dirName, int fat_starts, int fat_blocks, struct AllocSummary* summary, off_t* entryOffset) {
     // Find an empty entry in the directory
     int emptyEntryIndex = -1;
     struct dir_entry_t* dirPtr = (struct dir_entry_t*)(file + block_start * block_size);
@@ -215,12 +374,11 @@ int createDirectories(char* file, int block_size, int block_start, int block_cou
     }
 
     // Find an unused block in the FAT for the new directory
-    int newDirBlock = -1;
-    for (int i = 0; i < fat_blocks * block_size / sizeof(uint32_t); i++) {
-        if (fatPtr[i] == 0x00000000) {
-            newDirBlock = i;
-            break;
-        }
+    // A block the FAT has in use means the summary is stale, so rebuild it and look again
+    int newDirBlock = findFreeBlock(summary, 0);
+    if (newDirBlock != -1 && fatPtr[newDirBlock] != 0x00000000) {
+        rebuildAllocSummary(summary, fatPtr);
+        newDirBlock = findFreeBlock(summary, 0);
     }
 
     if (newDirBlock == -1) {
@@ -228,6 +386,15 @@ int createDirectories(char* file, int block_size, int block_start, int block_cou
         exit(EXIT_FAILURE);
     }
 
+    // Clear the new directory block and claim it in the FAT before it is reachable
+    markBlockAllocated(summary, newDirBlock);
+    memset(file + newDirBlock * block_size, 0, block_size);
+    off_t fat_offset = (off_t)fat_starts * block_size;
+    off_t fat_length = (off_t)fat_blocks * block_size;
+    lockRange(fd, F_WRLCK, fat_offset, fat_length);
+    fatPtr[newDirBlock] = htonl(0xFFFFFFFF);
+    unlockRange(fd, fat_offset, fat_length);
+
     // time
     time_t t = time(NULL);
     struct tm tm = *localtime(&t);
@@ -235,7 +402,7 @@ int createDirectories(char* file, int block_size, int block_start, int block_cou
     // Create a new entry for the directory
     struct dir_entry_t newDirEntry;
     memset(&newDirEntry, 0, sizeof(struct dir_entry_t));
-    newDirEntry.status = 0x05; // Directory
+    newDirEntry.status = 0x00; // Marked as a directory once the entry is written
     newDirEntry.starting_block = htonl(newDirBlock); // New directory starts at newDirBlock
     newDirEntry.block_count = htonl(1); // New directory has 1 block
     newDirEntry.size = htonl(block_size*block_count);
@@ -248,26 +415,27 @@ int createDirectories(char* file, int block_size, int block_start, int block_cou
     newDirEntry.modify_time.second = tm.tm_sec;
     newDirEntry.create_time = newDirEntry.modify_time;
 
-    strncpy((char*)newDirEntry.filename, dirName, 31);
+    strncpy((char*)newDirEntry.filename, dirName, 30);
 
-    // Write the new entry back to the directory
+    // Write the new entry back to the directory, publishing it last
     dirPtr[emptyEntryIndex] = newDirEntry;
-
-    // Update the FAT entry for the new directory
-    fatPtr[newDirBlock] = htonl(0xFFFFFFFF);
+    __atomic_store_n(&dirPtr[emptyEntryIndex].status, 0x05, __ATOMIC_RELEASE);
+    *entryOffset = (char*)&dirPtr[emptyEntryIndex] - file;
 
     return ntohl(newDirEntry.starting_block);
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        printf("Usage: %s <file_system_image> <source_file> <dest_path(optional)/filename>\n", argv[0]);
+    // -z stores the file compressed
+    int compress = (argc == 5 && strcmp(argv[1], "-z") == 0);
+    if (argc != 4 + compress) {
+        printf("Usage: %s [-z] <file_system_image> <source_file> <dest_path(optional)/filename>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    char* fileSystemImage = argv[1];
-    char* fileToCopy = argv[2];
-    char* destinationPath = argv[3];
+    char* fileSystemImage = argv[1 + compress];
+    char* fileToCopy = argv[2 + compress];
+    char* destinationPath = argv[3 + compress];
 
     // Open the file system image
     int fd = open(fileSystemImage, O_RDWR);
@@ -276,6 +444,9 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Only one writer at a time; readers never take this lock
+    lockRange(fd, F_WRLCK, WRITER_LOCK_START, WRITER_LOCK_LEN);
+
     struct stat buffer;
     fstat(fd, &buffer);
     int size = buffer.st_size;
@@ -300,6 +471,13 @@ int main(int argc, char* argv[]) {
     // Read FAT information
     uint32_t* fatPtr = (uint32_t*)(file + superBlock.fat_starts * superBlock.block_size);
 
+    // Load the allocation summary, rebuilding it if the image changed since it was saved
+    uint32_t fat_entries = superBlock.fat_blocks * superBlock.block_size / sizeof(uint32_t);
+    struct AllocSummary summary;
+    if (!loadAllocSummary(fileSystemImage, fd, file, fat_entries, &summary)) {
+        buildAllocSummary(fatPtr, fat_entries, &summary);
+    }
+
     // Check if the specified file exists in the current Linux directory
     FILE* linuxFile = fopen(fileToCopy, "r");
     if (!linuxFile) {
@@ -311,12 +489,44 @@ int main(int argc, char* argv[]) {
     int newFileSize = ftell(linuxFile);
     fclose(linuxFile);
 
+    // Map the path index to find the destination directory and record new entries
+    char fullPath[INDEX_MAX_PATH];
+    if (!normalizePath(destinationPath, fullPath, sizeof(fullPath))) {
+        printf("Error: Destination path is too long.\n");
+        exit(EXIT_FAILURE);
+    }
+    struct PathIndex index;
+    int indexValid = openPathIndex(fileSystemImage, fd, file, 1, &index);
+
     // Check if the specified destination path exists in the FAT image
-    char* token = (char*)strtok(destinationPath, "/");
     int block_start = superBlock.root_dir_starts;
     int block_count = superBlock.root_dir_blocks;
     char* filename = NULL;
 
+    // Start from the parent directory when the index knows it; otherwise walk from the root
+    char* walkPath = fullPath;
+    char currentPath[INDEX_MAX_PATH] = "";
+    char* lastSlash = strrchr(fullPath, '/');
+    if (indexValid && lastSlash != fullPath) {
+        *lastSlash = '\0';
+        const struct IndexEntry* entry = lookupPath(&index, fullPath);
+        struct dir_entry_t* dirPtr = entry ? (struct dir_entry_t*)resolveIndexEntry(file, size, superBlock.block_size, entry, strrchr(fullPath, '/') + 1) : NULL;
+        if (dirPtr != NULL && dirPtr->status == 0x05) {
+            block_start = ntohl(dirPtr->starting_block);
+            block_count = ntohl(dirPtr->block_count);
+            strcpy(currentPath, fullPath);
+            walkPath = lastSlash + 1;
+        }
+        *lastSlash = '/';
+    }
+
+    // Entries created below, with their full paths, to add to the index afterwards
+    int createdCount = 0;
+    off_t createdOffsets[INDEX_MAX_PATH / 2];
+    char* createdPaths[INDEX_MAX_PATH / 2];
+
+    char* token = (char*)strtok(walkPath, "/");
+
     while (token != NULL) {
         char* nextToken = strtok(NULL, "/");
         if (nextToken == NULL) {
@@ -350,24 +560,23 @@ int main(int argc, char* argv[]) {
         int found = 0;
 
         for (int i = 0; i < block_count * superBlock.block_size / sizeof(struct dir_entry_t); i++) {
-            struct dir_entry_t dirEntry = dirPtr[i];
-            dirEntry.size = ntohl(dirEntry.size);
-            dirEntry.starting_block = ntohl(dirEntry.starting_block);
-            dirEntry.block_count = ntohl(dirEntry.block_count);
-            dirEntry.create_time.year = ntohs(dirEntry.create_time.year);
-            dirEntry.modify_time.year = ntohs(dirEntry.modify_time.year);
-            // Check if the entry is a existing directory
-            if (dirEntry.status == 0x05 && strcasecmp((const char*)dirEntry.filename, token) == 0) {
-                block_start = dirEntry.starting_block;
-                block_count = dirEntry.block_count;
+            // Check if the entry is a existing directory, converting only the match
+            if (dirPtr[i].status == 0x05 && strcasecmp((const char*)dirPtr[i].filename, token) == 0) {
+                block_start = ntohl(dirPtr[i].starting_block);
+                block_count = ntohl(dirPtr[i].block_count);
+                strcat(currentPath, "/");
+                strncat(currentPath, (const char*)dirPtr[i].filename, DIR_ENTRY_FILENAME_LENGTH);
                 found = 1;
                 break;
             } 
         }
         if (found == 0) {
             // Create a new directory entry in the given path
-            block_start=createDirectories(file, superBlock.block_size, block_start, block_count, fatPtr, token, superBlock.fat_starts, superBlock.fat_blocks);
+            block_start=createDirectories(fd, file, superBlock.block_size, block_start, block_count, fatPtr, token, superBlock.fat_starts, superBlock.fat_blocks, &summary, &createdOffsets[createdCount]);
             block_count = 1;
+            strcat(currentPath, "/");
+            strncat(currentPath, file + createdOffsets[createdCount] + DIR_ENTRY_FILENAME, DIR_ENTRY_FILENAME_LENGTH);
+            createdPaths[createdCount++] = strdup(currentPath);
 
         }
 
@@ -375,10 +584,34 @@ int main(int argc, char* argv[]) {
     }
 
     // Create a new file entry in the given path
-    createNewFile(fileToCopy, filename, file, superBlock.block_size, block_start, block_count, fatPtr, newFileSize, superBlock.fat_starts, superBlock.fat_blocks);
+    createdOffsets[createdCount] = createNewFile(fd, fileToCopy, filename, file, superBlock.block_size, block_start, block_count, fatPtr, newFileSize, superBlock.fat_starts, superBlock.fat_blocks, &summary, compress);
+    strcat(currentPath, "/");
+    strcat(currentPath, filename);
+    createdPaths[createdCount++] = strdup(currentPath);
 
-    // Unmap the file
+    // Flush the changes, bump the generation and save the summary that matches it
     msync(file, size, MS_SYNC);
+    bumpGeneration(file);
+    msync(file, size, MS_SYNC);
+    saveAllocSummary(fileSystemImage, fd, file, &summary);
+    freeAllocSummary(&summary);
+
+    // Add the new entries to the index in place, rebuilding it if it was stale or is full
+    for (int i = 0; i < createdCount; i++) {
+        if (indexValid) {
+            indexValid = updateIndexEntry(&index, createdPaths[i], file, superBlock.block_size, createdOffsets[i]);
+        }
+        free(createdPaths[i]);
+    }
+    if (indexValid) {
+        restampPathIndex(&index, fd, file);
+        closePathIndex(&index);
+    } else {
+        closePathIndex(&index);
+        buildPathIndex(fileSystemImage, fd, file, size);
+    }
+
+    // Unmap the file
 
     munmap(file, size);
 
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "disklock.h"
+
+#define COPY_BUFFER_SIZE (1 << 20)
+
+// Function to clone the image by sharing its extents (btrfs, XFS, ...)
+int reflinkCopy(int src_fd, int dst_fd) {
+#ifdef FICLONE
+    return ioctl(dst_fd, FICLONE, src_fd) == 0;
+#else
+    return 0;
+#endif
+}
+
+// Function to copy the image inside the kernel
+// copy_file_range may still share extents on filesystems that support it
+int kernelCopy(int src_fd, int dst_fd, off_t size) {
+    off_t src_offset = 0;
+    off_t dst_offset = 0;
+    while (src_offset < size) {
+        ssize_t copied = copy_file_range(src_fd, &src_offset, dst_fd, &dst_offset, size - src_offset, 0);
+        if (copied == -1 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to copy the image through a user-space buffer
+// Returns 0 if reading or writing fails
+int plainCopy(int src_fd, int dst_fd, off_t size) {
+    char* buffer = (char*)malloc(COPY_BUFFER_SIZE);
+    if (!buffer) {
+        perror("malloc");
+        return 0;
+    }
+
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t length = pread(src_fd, buffer, COPY_BUFFER_SIZE, offset);
+        if (length == -1 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            perror("read");
+            free(buffer);
+            return 0;
+        }
+        for (ssize_t written = 0; written < length;) {
+            ssize_t result = pwrite(dst_fd, buffer + written, length - written, offset + written);
+            if (result == -1 && errno == EINTR) {
+                continue;
+            }
+            if (result == -1) {
+                perror("write");
+                free(buffer);
+                return 0;
+            }
+            written += result;
+        }
+        offset += length;
+    }
+
+    free(buffer);
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        printf("Usage: %s <file_system_image> <snapshot_image>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Open the file system image read-only
+    int src_fd = open(argv[1], O_RDONLY);
+    if (src_fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    // Keep writers out while copying by sharing their lock; readers and other snapshots still run
+    lockRange(src_fd, F_RDLCK, WRITER_LOCK_START, WRITER_LOCK_LEN);
+
+    struct stat buffer;
+    fstat(src_fd, &buffer);
+    off_t size = buffer.st_size;
+
+    // Never replace the image with its own snapshot, even through a symlink
+    struct stat target;
+    if (stat(argv[2], &target) == 0 && target.st_dev == buffer.st_dev && target.st_ino == buffer.st_ino) {
+        printf("Error: Snapshot would overwrite the image.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Copy into a new temporary file and rename it over the snapshot path when complete
+    char temp_path[4096 + 32];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", argv[2], (int)getpid());
+    int dst_fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (dst_fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    // Prefer a reflink clone, then an in-kernel copy, then a plain copy
+    const char* method = "reflink";
+    int ok = reflinkCopy(src_fd, dst_fd);
+    if (!ok) {
+        method = "copy_file_range";
+        ok = ftruncate(dst_fd, 0) == 0 && kernelCopy(src_fd, dst_fd, size);
+    }
+    if (!ok) {
+        method = "copy";
+        ok = ftruncate(dst_fd, 0) == 0 && plainCopy(src_fd, dst_fd, size);
+    }
+    if (ok && fsync(dst_fd) == -1) {
+        perror("fsync");
+        ok = 0;
+    }
+    close(dst_fd);
+    if (ok && rename(temp_path, argv[2]) == -1) {
+        perror("rename");
+        ok = 0;
+    }
+    if (!ok) {
+        unlink(temp_path);
+        exit(EXIT_FAILURE);
+    }
+    printf("Snapshot created (%s).\n", method);
+
+    unlockRange(src_fd, WRITER_LOCK_START, WRITER_LOCK_LEN);
+
+    // Close the file
+    close(src_fd);
+
+    return 0;
+}